@@ -0,0 +1,503 @@
+/**
+ * Throughput benchmark for query. It generates synthetic file trees, runs
+ * query over them with a matrix of commands, delimiters and options and
+ * prints one tab-separated line of results per run to stdout. Refer to the
+ * "usage" function for more information.
+ */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+void generate_trees(void);
+int main(int, char **);
+void make_directory(const char *);
+void make_file(const char *, size_t);
+double parent_cpu_seconds(const char *);
+void run(const char *, const char *, const char *, const char *, const char *);
+void usage(char *);
+void write_lists(const char *, char **, size_t);
+
+/**
+ * Synthetic trees the benchmark is run against.
+ */
+static const char *trees[] = {"tiny", "huge", "deep"};
+
+/**
+ * Commands run by query. "cat" reads all of its input while the others do not
+ * read anything, which makes it easy to tell process creation overhead apart
+ * from I/O.
+ */
+static const char *commands[] = {"/bin/true", "/bin/false", "cat"};
+
+/**
+ * Delimiter options and the suffix of the input list each one reads.
+ */
+static const char *delimiters[][2] = {
+    {"-n", "lines"},
+    {"-0", "nul"},
+    {"-w", "words"},
+};
+
+/**
+ * Options exercising built-in modes of query. These are only combined with the
+ * default delimiter to keep the number of runs down.
+ */
+static const char *modes[] = {"-!", "--json"};
+
+/**
+ * Values passed to "-j": one child at a time, one child per CPU and the
+ * adaptive limit. Only the first is combined with every delimiter and mode.
+ */
+static const char *job_counts[] = {"1", "0", "auto"};
+
+/**
+ * Path of the query executable, the directory the trees are generated in and
+ * a multiplier for the number and size of files.
+ */
+static const char *query_path;
+static char *work_directory;
+static double scale = 1;
+
+/**
+ * Number of files in each tree indexed like "trees".
+ */
+static size_t file_counts[sizeof(trees) / sizeof(trees[0])];
+
+/**
+ * Display application usage information.
+ *
+ * @param self  Name or path of compiled executable.
+ */
+void usage(char *self)
+{
+    printf(
+        "Usage: %s [-d DIRECTORY] [-s SCALE] QUERY\n"
+        "\n"
+        "Generate synthetic file trees and measure the throughput of the query "
+        "executable\nat the path QUERY. Results are written to stdout as "
+        "tab-separated values with\na header line. The files/s column is the "
+        "number of files processed per second\nof wall time and the "
+        "parent_cpu_us/file column is the CPU time used by query\nitself, "
+        "excluding its children, per file.\n"
+        "\n"
+        "Options:\n"
+        " -d DIRECTORY  Generate the trees in DIRECTORY instead of a new "
+        "temporary\n"
+        "               directory. Existing trees are reused.\n"
+        " -h            Show this text and exit.\n"
+        " -s SCALE      Multiply the number of tiny and deep files and the "
+        "size of the\n"
+        "               huge files by SCALE. Defaults to 1.\n"
+        , self
+    );
+}
+
+/**
+ * Create a directory if it does not already exist. The program exits with a
+ * status of 1 on failure.
+ *
+ * @param path  Path of the directory.
+ */
+void make_directory(const char *path)
+{
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/**
+ * Create a file filled with a repeating pattern unless a file of the same size
+ * already exists. The program exits with a status of 1 on failure.
+ *
+ * @param path  Path of the file.
+ * @param size  Size of the file in bytes.
+ */
+void make_file(const char *path, size_t size)
+{
+    static char block[65536];
+    size_t chunk;
+    int fd;
+    struct stat status;
+
+    if (stat(path, &status) == 0 && (size_t) status.st_size == size) {
+        return;
+    }
+
+    if (!block[0]) {
+        for (chunk = 0; chunk < sizeof(block); chunk++) {
+            block[chunk] = (char) ('a' + chunk % 26);
+        }
+        block[sizeof(block) - 1] = '\n';
+    }
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        perror(path);
+        exit(1);
+    }
+
+    for (; size; size -= chunk) {
+        chunk = size < sizeof(block) ? size : sizeof(block);
+        if (write(fd, block, chunk) != (ssize_t) chunk) {
+            perror(path);
+            exit(1);
+        }
+    }
+
+    close(fd);
+}
+
+/**
+ * Write the newline, null byte and whitespace delimited input lists for a
+ * tree. The whitespace delimited list puts several paths on each line.
+ *
+ * @param tree   Name of the tree.
+ * @param paths  Paths of the files in the tree.
+ * @param count  Number of paths.
+ */
+void write_lists(const char *tree, char **paths, size_t count)
+{
+    size_t delimiter;
+    size_t index;
+    char list_path[4096];
+    FILE *stream;
+
+    for (delimiter = 0; delimiter < 3; delimiter++) {
+        snprintf(list_path, sizeof(list_path), "%s/%s.%s", work_directory,
+            tree, delimiters[delimiter][1]);
+        if (!(stream = fopen(list_path, "w"))) {
+            perror(list_path);
+            exit(1);
+        }
+
+        for (index = 0; index < count; index++) {
+            fputs(paths[index], stream);
+            if (delimiter == 1) {
+                putc('\0', stream);
+            } else if (delimiter == 2 && index % 8 != 7) {
+                putc(index % 2 ? '\t' : ' ', stream);
+            } else {
+                putc('\n', stream);
+            }
+        }
+
+        if (fclose(stream) == EOF) {
+            perror(list_path);
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Generate the synthetic trees and their input lists:
+ *
+ * - tiny: many 64-byte files spread over 100 directories.
+ * - huge: a few 64 MiB files.
+ * - deep: chains of nested directories with a file at every level.
+ */
+void generate_trees(void)
+{
+    size_t count;
+    size_t depth;
+    size_t index;
+    size_t length;
+    char path[4096];
+    char **paths;
+
+    // Tiny files.
+    count = (size_t) (4000 * scale);
+    count = count ? count : 1;
+    paths = malloc(count * sizeof(*paths));
+    snprintf(path, sizeof(path), "%s/tiny", work_directory);
+    make_directory(path);
+    for (index = 0; index < count; index++) {
+        snprintf(path, sizeof(path), "%s/tiny/%03zu", work_directory,
+            index % 100);
+        make_directory(path);
+        snprintf(path, sizeof(path), "%s/tiny/%03zu/%06zu.txt",
+            work_directory, index % 100, index);
+        make_file(path, 64);
+        paths[index] = strdup(path);
+    }
+    write_lists("tiny", paths, count);
+    file_counts[0] = count;
+    for (index = 0; index < count; index++) {
+        free(paths[index]);
+    }
+    free(paths);
+
+    // Huge files.
+    count = 4;
+    paths = malloc(count * sizeof(*paths));
+    snprintf(path, sizeof(path), "%s/huge", work_directory);
+    make_directory(path);
+    for (index = 0; index < count; index++) {
+        snprintf(path, sizeof(path), "%s/huge/%zu.bin", work_directory, index);
+        make_file(path, (size_t) (64 * 1024 * 1024 * scale));
+        paths[index] = strdup(path);
+    }
+    write_lists("huge", paths, count);
+    file_counts[1] = count;
+    for (index = 0; index < count; index++) {
+        free(paths[index]);
+    }
+    free(paths);
+
+    // Deep directories: 32 levels per chain.
+    count = (size_t) (32 * 32 * scale);
+    count = count ? count : 1;
+    paths = malloc(count * sizeof(*paths));
+    snprintf(path, sizeof(path), "%s/deep", work_directory);
+    make_directory(path);
+    for (index = 0; index < count; index++) {
+        depth = index % 32;
+        if (depth == 0) {
+            snprintf(path, sizeof(path), "%s/deep/chain-%04zu",
+                work_directory, index / 32);
+        } else {
+            length = strlen(path);
+            snprintf(path + length, sizeof(path) - length,
+                "/level-%02zu", depth);
+        }
+        make_directory(path);
+        length = strlen(path);
+        snprintf(path + length, sizeof(path) - length, "/file.txt");
+        make_file(path, 64);
+        paths[index] = strdup(path);
+        path[length] = '\0';
+    }
+    write_lists("deep", paths, count);
+    file_counts[2] = count;
+    for (index = 0; index < count; index++) {
+        free(paths[index]);
+    }
+    free(paths);
+}
+
+/**
+ * Read the CPU time used by query itself from the Prometheus text file it
+ * wrote with "--metrics-file".
+ *
+ * @param path  Path of the metrics file.
+ *
+ * @return Number of CPU seconds or -1 if the value could not be found.
+ */
+double parent_cpu_seconds(const char *path)
+{
+    char buffer[256];
+    double seconds;
+    FILE *stream;
+
+    seconds = -1;
+    if (!(stream = fopen(path, "r"))) {
+        return seconds;
+    }
+
+    while (fgets(buffer, sizeof(buffer), stream)) {
+        if (sscanf(buffer, "process_cpu_seconds_total %lf", &seconds) == 1) {
+            break;
+        }
+    }
+
+    fclose(stream);
+    return seconds;
+}
+
+/**
+ * Run query once over a tree and print a line of results.
+ *
+ * @param tree       Name of the tree.
+ * @param command    COMMAND passed to query.
+ * @param delimiter  Delimiter option passed to query.
+ * @param mode       Additional option passed to query or NULL.
+ * @param jobs       Value passed to "-j".
+ */
+void run(const char *tree, const char *command, const char *delimiter,
+  const char *mode, const char *jobs)
+{
+    char *argv[10];
+    double cpu;
+    size_t files;
+    size_t index;
+    const char *list_suffix;
+    char list_path[4096];
+    char metrics_argument[4096 + 16];
+    char metrics_path[4096];
+    int null_fd;
+    int list_fd;
+    pid_t pid;
+    double seconds;
+    struct timespec start;
+    int status;
+    struct timespec stop;
+
+    list_suffix = NULL;
+    for (index = 0; index < 3; index++) {
+        if (!strcmp(delimiters[index][0], delimiter)) {
+            list_suffix = delimiters[index][1];
+        }
+    }
+
+    files = 0;
+    for (index = 0; index < 3; index++) {
+        if (!strcmp(trees[index], tree)) {
+            files = file_counts[index];
+        }
+    }
+
+    snprintf(list_path, sizeof(list_path), "%s/%s.%s", work_directory, tree,
+        list_suffix);
+    snprintf(metrics_path, sizeof(metrics_path), "%s/metrics.prom",
+        work_directory);
+    snprintf(metrics_argument, sizeof(metrics_argument), "--metrics-file=%s",
+        metrics_path);
+    unlink(metrics_path);
+
+    index = 0;
+    argv[index++] = (char *) query_path;
+    argv[index++] = (char *) delimiter;
+    argv[index++] = metrics_argument;
+    argv[index++] = "-j";
+    argv[index++] = (char *) jobs;
+    if (mode) {
+        argv[index++] = (char *) mode;
+    }
+    argv[index++] = (char *) command;
+    argv[index] = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    switch ((pid = fork())) {
+      case -1:
+        perror("fork");
+        exit(1);
+
+      case 0:
+        if ((list_fd = open(list_path, O_RDONLY)) == -1 ||
+            (null_fd = open("/dev/null", O_WRONLY)) == -1 ||
+            dup2(list_fd, STDIN_FILENO) == -1 ||
+            dup2(null_fd, STDOUT_FILENO) == -1) {
+
+            perror(list_path);
+            _exit(1);
+        }
+        execv(query_path, argv);
+        perror(query_path);
+        _exit(1);
+    }
+
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    // An exit status of 2 only means some files could not be queried.
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0 &&
+      WEXITSTATUS(status) != 2)) {
+        fprintf(stderr, "%s: query failed for %s %s %s %s -j %s\n",
+            query_path, tree, command, delimiter, mode ? mode : "-", jobs);
+        exit(1);
+    }
+
+    seconds = (stop.tv_sec - start.tv_sec) +
+        (stop.tv_nsec - start.tv_nsec) / 1e9;
+    cpu = parent_cpu_seconds(metrics_path);
+
+    printf("%s\t%s\t%s\t%s\t%s\t%zu\t%.6f\t%.1f\t", tree, command,
+        delimiter, mode ? mode : "-", jobs, files, seconds, files / seconds);
+    if (cpu < 0) {
+        puts("NA");
+    } else {
+        printf("%.2f\n", cpu * 1e6 / files);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    size_t command;
+    size_t delimiter;
+    char *end;
+    size_t jobs;
+    size_t mode;
+    int option;
+    char temporary_directory[] = "/tmp/query-bench.XXXXXX";
+    size_t tree;
+
+    work_directory = NULL;
+
+    while ((option = getopt(argc, argv, "+d:hs:")) != -1) {
+        switch (option) {
+          case 'd':
+            work_directory = optarg;
+            make_directory(work_directory);
+            break;
+          case 'h':
+            usage(argv[0]);
+            return 0;
+          case 's':
+            scale = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || !(scale > 0)) {
+                fprintf(stderr, "%s: invalid scale -- '%s'\n", argv[0],
+                    optarg);
+                return 1;
+            }
+            break;
+          default:
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fputs("No query executable specified.\n", stderr);
+        return 1;
+    }
+
+    query_path = argv[optind];
+
+    if (!work_directory) {
+        if (!(work_directory = mkdtemp(temporary_directory))) {
+            perror("mkdtemp");
+            return 1;
+        }
+        fprintf(stderr, "%s: generating trees in %s\n", argv[0],
+            work_directory);
+    }
+
+    generate_trees();
+
+    puts("tree\tcommand\tdelimiter\tmode\tjobs\tfiles\tseconds\tfiles/s\t"
+        "parent_cpu_us/file");
+
+    for (tree = 0; tree < sizeof(trees) / sizeof(trees[0]); tree++) {
+        for (command = 0; command < sizeof(commands) / sizeof(commands[0]);
+          command++) {
+            for (delimiter = 0; delimiter < 3; delimiter++) {
+                run(trees[tree], commands[command], delimiters[delimiter][0],
+                    NULL, job_counts[0]);
+            }
+            for (mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++) {
+                run(trees[tree], commands[command], "-n", modes[mode],
+                    job_counts[0]);
+            }
+            for (jobs = 1; jobs < sizeof(job_counts) / sizeof(job_counts[0]);
+              jobs++) {
+                run(trees[tree], commands[command], "-n", NULL,
+                    job_counts[jobs]);
+            }
+        }
+    }
+
+    return 0;
+}
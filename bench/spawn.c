@@ -0,0 +1,409 @@
+/**
+ * Process creation benchmark. It repeats the per-file spawn path of query
+ * (open a file, make it the child's stdin, redirect stdout and stderr to
+ * /dev/null, exec the command and reap it) with several process creation
+ * strategies while the parent's resident set is inflated to different sizes.
+ * Refer to the "usage" function for more information.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(CLONE_VM) && defined(CLONE_VFORK)
+#define HAVE_CLONE
+#endif
+
+/**
+ * Ways of creating a child process.
+ */
+typedef enum {
+    FORK_BACKEND,
+    VFORK_BACKEND,
+    POSIX_SPAWN_BACKEND,
+    CLONE_BACKEND,
+} backend_et;
+
+int clone_child(void *);
+int compare_latencies(const void *, const void *);
+long long monotonic_ns(void);
+int main(int, char **);
+size_t parse_list(const char *, double *, size_t);
+void run(backend_et, size_t, size_t);
+pid_t spawn(backend_et, int);
+void usage(char *);
+
+extern char **environ;
+
+/**
+ * Names of the backends indexed by backend_et.
+ */
+static const char *backend_names[] = {"fork", "vfork", "posix_spawn", "clone"};
+
+/**
+ * Command executed by every child, the file used as its stdin and a
+ * descriptor for /dev/null.
+ */
+static char *command[] = {"/bin/true", NULL};
+static const char *input_path = "/etc/hostname";
+static int dev_null_fd;
+
+/**
+ * Stack of children created with clone(2). With CLONE_VFORK, the parent is
+ * suspended until the child has exec'd, so one stack is enough.
+ */
+#ifdef HAVE_CLONE
+static long long clone_stack[65536 / sizeof(long long)];
+#endif
+
+/**
+ * Number of children created for each combination of backend, resident set
+ * size and concurrency.
+ */
+static size_t iterations = 2000;
+
+/**
+ * Time spent in the parent creating each child in nanoseconds.
+ */
+static long long *latencies;
+
+/**
+ * Display application usage information.
+ *
+ * @param self  Name or path of compiled executable.
+ */
+void usage(char *self)
+{
+    printf(
+        "Usage: %s [-c COMMAND] [-f FILE] [-j JOBS] [-n COUNT] [-r SIZES]\n"
+        "\n"
+        "Measure how quickly children can be created with fork(2), vfork(2), "
+        "posix_spawn(3)\nand clone(2) while the resident set of the parent "
+        "is inflated. Results are\nwritten to stdout as tab-separated values "
+        "with a header line. Latencies are\nthe time the parent spends "
+        "creating each child; spawns/s includes reaping.\n"
+        "\n"
+        "Options:\n"
+        " -c COMMAND  Executable run by each child. Defaults to /bin/true.\n"
+        " -f FILE     File used as the stdin of each child. Defaults to "
+        "/etc/hostname.\n"
+        " -h          Show this text and exit.\n"
+        " -j JOBS     Comma-separated numbers of children kept running at "
+        "once.\n"
+        "             Defaults to 1,4,16.\n"
+        " -n COUNT    Number of children created for each combination. "
+        "Defaults to\n"
+        "             2000.\n"
+        " -r SIZES    Comma-separated resident set sizes of the parent in "
+        "MiB.\n"
+        "             Defaults to 10,1024.\n"
+        , self
+    );
+}
+
+/**
+ * Return the value of the monotonic clock in nanoseconds.
+ */
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Comparison function for qsort(3) that sorts latencies in ascending order.
+ */
+int compare_latencies(const void *a, const void *b)
+{
+    long long left = *(const long long *) a;
+    long long right = *(const long long *) b;
+
+    return (left > right) - (left < right);
+}
+
+/**
+ * Parse a comma-separated list of positive numbers. The program exits with a
+ * status of 1 when the list is invalid.
+ *
+ * @param text      List to parse.
+ * @param values    Destination for the values.
+ * @param capacity  Maximum number of values.
+ *
+ * @return Number of values parsed.
+ */
+size_t parse_list(const char *text, double *values, size_t capacity)
+{
+    size_t count;
+    char *end;
+
+    for (count = 0; count < capacity; text = end + 1) {
+        values[count] = strtod(text, &end);
+        if (end == text || !(values[count] > 0) ||
+          (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "invalid list -- '%s'\n", text);
+            exit(1);
+        }
+        count++;
+        if (*end == '\0') {
+            break;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Entry point of children created with clone(2). Since they share the memory
+ * of the parent, they only set up their descriptors and exec like
+ * posix_spawn(3) does.
+ *
+ * @param argument  Pointer to the descriptor used as stdin.
+ */
+int clone_child(void *argument)
+{
+    if (dup2(*(int *) argument, STDIN_FILENO) == -1 ||
+        dup2(dev_null_fd, STDOUT_FILENO) == -1 ||
+        dup2(dev_null_fd, STDERR_FILENO) == -1) {
+        _exit(126);
+    }
+    execv(command[0], command);
+    _exit(127);
+}
+
+/**
+ * Create a child that runs the command with its stdin, stdout and stderr
+ * set up like query does.
+ *
+ * @param backend   Way of creating the child.
+ * @param input_fd  Descriptor used as the child's stdin.
+ *
+ * @return PID of the child. The program exits with a status of 1 on failure.
+ */
+pid_t spawn(backend_et backend, int input_fd)
+{
+    posix_spawn_file_actions_t actions;
+    int error;
+    pid_t pid;
+
+    switch (backend) {
+      case FORK_BACKEND:
+        pid = fork();
+        break;
+
+      case VFORK_BACKEND:
+        pid = vfork();
+        break;
+
+      case POSIX_SPAWN_BACKEND:
+        if ((error = posix_spawn_file_actions_init(&actions)) ||
+            (error = posix_spawn_file_actions_adddup2(&actions, input_fd,
+              STDIN_FILENO)) ||
+            (error = posix_spawn_file_actions_adddup2(&actions, dev_null_fd,
+              STDOUT_FILENO)) ||
+            (error = posix_spawn_file_actions_adddup2(&actions, dev_null_fd,
+              STDERR_FILENO)) ||
+            (error = posix_spawn(&pid, command[0], &actions, NULL, command,
+              environ))) {
+
+            fprintf(stderr, "posix_spawn: %s\n", strerror(error));
+            exit(1);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+        return pid;
+
+      case CLONE_BACKEND:
+#ifdef HAVE_CLONE
+        // The child shares the address space and runs on its own stack, so
+        // nothing is copied no matter how large the parent is. The stack
+        // grows down on every architecture Linux supports but PA-RISC.
+        pid = clone(clone_child, (char *) clone_stack + sizeof(clone_stack),
+            CLONE_VM | CLONE_VFORK | SIGCHLD, &input_fd);
+        if (pid == -1) {
+            perror(backend_names[backend]);
+            exit(1);
+        }
+        return pid;
+#endif
+      default:
+        fputs("Backend not supported on this platform.\n", stderr);
+        exit(1);
+    }
+
+    if (pid == -1) {
+        perror(backend_names[backend]);
+        exit(1);
+    } else if (pid == 0) {
+        if (dup2(input_fd, STDIN_FILENO) == -1 ||
+            dup2(dev_null_fd, STDOUT_FILENO) == -1 ||
+            dup2(dev_null_fd, STDERR_FILENO) == -1) {
+            _exit(126);
+        }
+        execv(command[0], command);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+/**
+ * Create and reap "iterations" children with a backend and print a line of
+ * results.
+ *
+ * @param backend  Way of creating children.
+ * @param rss_mib  Resident set size of the parent in MiB used for reporting.
+ * @param jobs     Number of children kept running at once.
+ */
+void run(backend_et backend, size_t rss_mib, size_t jobs)
+{
+    int input_fd;
+    size_t running;
+    size_t spawned;
+    long long start;
+    int status;
+    long long stop;
+    long long wall_start;
+
+    running = 0;
+    wall_start = monotonic_ns();
+
+    for (spawned = 0; spawned < iterations || running; ) {
+        if (spawned < iterations && running < jobs) {
+            if ((input_fd = open(input_path, O_RDONLY)) == -1) {
+                perror(input_path);
+                exit(1);
+            }
+            start = monotonic_ns();
+            spawn(backend, input_fd);
+            stop = monotonic_ns();
+            close(input_fd);
+            latencies[spawned++] = stop - start;
+            running++;
+            continue;
+        }
+
+        if (wait(&status) == -1) {
+            perror("wait");
+            exit(1);
+        } else if (!WIFEXITED(status) || WEXITSTATUS(status) >= 126) {
+            fprintf(stderr, "%s: child could not run %s\n",
+                backend_names[backend], command[0]);
+            exit(1);
+        }
+        running--;
+    }
+
+    stop = monotonic_ns();
+    qsort(latencies, iterations, sizeof(*latencies), compare_latencies);
+    printf("%s\t%zu\t%zu\t%zu\t%.6f\t%.1f\t%.1f\t%.1f\n",
+        backend_names[backend], rss_mib, jobs, iterations,
+        (stop - wall_start) / 1e9, iterations * 1e9 / (stop - wall_start),
+        latencies[iterations / 2] / 1e3,
+        latencies[iterations * 99 / 100] / 1e3);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    int backend;
+    char *ballast;
+    size_t ballast_size;
+    char *end;
+    size_t index;
+    double jobs[32];
+    size_t jobs_count;
+    int option;
+    double sizes[32];
+    size_t sizes_count;
+    size_t size;
+
+    jobs_count = parse_list("1,4,16", jobs, 32);
+    sizes_count = parse_list("10,1024", sizes, 32);
+
+    while ((option = getopt(argc, argv, "+c:f:hj:n:r:")) != -1) {
+        switch (option) {
+          case 'c':
+            command[0] = optarg;
+            break;
+          case 'f':
+            input_path = optarg;
+            break;
+          case 'h':
+            usage(argv[0]);
+            return 0;
+          case 'j':
+            jobs_count = parse_list(optarg, jobs, 32);
+            break;
+          case 'n':
+            iterations = (size_t) strtoul(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || !iterations) {
+                fprintf(stderr, "%s: invalid count -- '%s'\n", argv[0],
+                    optarg);
+                return 1;
+            }
+            break;
+          case 'r':
+            sizes_count = parse_list(optarg, sizes, 32);
+            break;
+          default:
+            return 1;
+        }
+    }
+
+    if ((dev_null_fd = open("/dev/null", O_WRONLY)) == -1) {
+        perror("/dev/null");
+        return 1;
+    } else if (!(latencies = malloc(iterations * sizeof(*latencies)))) {
+        perror("malloc");
+        return 1;
+    }
+
+    puts("backend\trss_mib\tjobs\tspawns\tseconds\tspawns/s\tp50_us\tp99_us");
+
+    ballast = NULL;
+    for (size = 0; size < sizes_count; size++) {
+        // Touch every page of the ballast so it is part of the resident set
+        // and has to be dealt with when the address space is copied.
+        free(ballast);
+        ballast_size = (size_t) (sizes[size] * 1024 * 1024);
+        if (!(ballast = malloc(ballast_size))) {
+            perror("malloc");
+            return 1;
+        }
+        memset(ballast, 1, ballast_size);
+
+        for (backend = FORK_BACKEND; backend <= CLONE_BACKEND; backend++) {
+#ifndef HAVE_CLONE
+            if (backend == CLONE_BACKEND) {
+                continue;
+            }
+#endif
+            for (index = 0; index < jobs_count; index++) {
+                run((backend_et) backend, (size_t) sizes[size],
+                    (size_t) jobs[index]);
+            }
+        }
+    }
+
+    free(ballast);
+    free(latencies);
+    return 0;
+}
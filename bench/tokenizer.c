@@ -0,0 +1,243 @@
+/**
+ * Microbenchmark for the input tokenizer of query. Generated path lists with
+ * different length distributions are fed through "read_path" for every
+ * delimation mode without opening any files or spawning any processes. Refer
+ * to the "usage" function for more information.
+ */
+#define main query_main
+#include "../query.c"
+#undef main
+
+void bench_usage(char *);
+void fill_path(char *, size_t);
+size_t generate_list(char **, delimation_et, size_t, size_t, size_t);
+size_t next_length(size_t, size_t);
+unsigned long random_number(void);
+
+/**
+ * Path length distributions. Lengths are drawn uniformly between the minimum
+ * and maximum except for "mixed" which draws the logarithm of the length
+ * uniformly so that short paths are common but very long paths still occur.
+ */
+static const struct {
+    const char *name;
+    size_t minimum;
+    size_t maximum;
+} distributions[] = {
+    {"short", 4, 16},
+    {"find", 20, 120},
+    {"long", 256, 1024},
+    {"mixed", 1, 4096},
+};
+
+/**
+ * Delimation modes and the options that select them.
+ */
+static const struct {
+    const char *option;
+    delimation_et delimation;
+} modes[] = {
+    {"-n", LINE_DELIMATION},
+    {"-0", NULL_BYTE_DELIMATION},
+    {"-w", ASCII_WHITESPACE_DELIMATION},
+};
+
+/**
+ * State of the pseudorandom number generator. A fixed seed keeps the generated
+ * lists identical between runs.
+ */
+static unsigned long long random_state = 0x9e3779b97f4a7c15ULL;
+
+/**
+ * Display application usage information.
+ *
+ * @param self  Name or path of compiled executable.
+ */
+void bench_usage(char *self)
+{
+    printf(
+        "Usage: %s [-m MEBIBYTES] [-t SECONDS]\n"
+        "\n"
+        "Measure the throughput of the input tokenizer of query for each "
+        "delimation mode\nand path length distribution. Results are written "
+        "to stdout as tab-separated\nvalues with a header line.\n"
+        "\n"
+        "Options:\n"
+        " -h            Show this text and exit.\n"
+        " -m MEBIBYTES  Size of each generated path list. Defaults to 16.\n"
+        " -t SECONDS    Minimum time spent measuring each combination. "
+        "Defaults to 0.5.\n"
+        , self
+    );
+}
+
+/**
+ * Return a pseudorandom number from a xorshift64* generator.
+ */
+unsigned long random_number(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (unsigned long) ((random_state * 2685821657736338717ULL) >> 32);
+}
+
+/**
+ * Return the length of the next path.
+ *
+ * @param minimum  Minimum length.
+ * @param maximum  Maximum length. When the minimum is 1, the logarithm of the
+ *                 length is drawn uniformly instead of the length itself.
+ */
+size_t next_length(size_t minimum, size_t maximum)
+{
+    size_t bits;
+    size_t length;
+
+    if (minimum == 1) {
+        for (bits = 0; ((size_t) 1 << bits) < maximum; bits++);
+        length = (size_t) 1 << (random_number() % (bits + 1));
+        length += random_number() % length;
+        return length < maximum ? length : maximum;
+    }
+
+    return minimum + random_number() % (maximum - minimum + 1);
+}
+
+/**
+ * Fill a buffer with characters resembling a path. None of the characters are
+ * whitespace so the same paths can be used with every delimation mode.
+ *
+ * @param path    Destination buffer.
+ * @param length  Number of characters to write.
+ */
+void fill_path(char *path, size_t length)
+{
+    static const char characters[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-/";
+    size_t index;
+
+    for (index = 0; index < length; index++) {
+        path[index] = characters[random_number() % (sizeof(characters) - 1)];
+    }
+}
+
+/**
+ * Generate a delimited list of paths.
+ *
+ * @param list        Set to a newly allocated buffer containing the list.
+ * @param delimation  Way the paths are delimited. For whitespace delimation,
+ *                    eight paths separated by spaces and tabs are put on each
+ *                    line.
+ * @param size        Approximate size of the list in bytes.
+ * @param minimum     Minimum path length.
+ * @param maximum     Maximum path length.
+ *
+ * @return Number of bytes in the list.
+ */
+size_t generate_list(char **list, delimation_et delimation, size_t size,
+  size_t minimum, size_t maximum)
+{
+    size_t count;
+    size_t length;
+    size_t used;
+
+    *list = xrealloc(NULL, size + maximum + 1);
+    for (count = 0, used = 0; used < size; count++) {
+        length = next_length(minimum, maximum);
+        fill_path(*list + used, length);
+        used += length;
+
+        if (delimation == NULL_BYTE_DELIMATION) {
+            (*list)[used++] = '\0';
+        } else if (delimation == ASCII_WHITESPACE_DELIMATION &&
+          count % 8 != 7) {
+            (*list)[used++] = count % 2 ? '\t' : ' ';
+        } else {
+            (*list)[used++] = '\n';
+        }
+    }
+
+    return used;
+}
+
+int main(int argc, char **argv)
+{
+    size_t distribution;
+    long long elapsed;
+    char *end;
+    char *list;
+    size_t list_size;
+    size_t mode;
+    int option;
+    size_t paths;
+    size_t rounds;
+    long long start;
+    FILE *stream;
+
+    double minimum_seconds = 0.5;
+    size_t size = 16 * 1024 * 1024;
+
+    while ((option = getopt(argc, argv, "+hm:t:")) != -1) {
+        switch (option) {
+          case 'h':
+            bench_usage(argv[0]);
+            return 0;
+          case 'm':
+            size = (size_t) (strtod(optarg, &end) * 1024 * 1024);
+            if (end == optarg || *end != '\0' || !size) {
+                fprintf(stderr, "%s: invalid size -- '%s'\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+          case 't':
+            minimum_seconds = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || !(minimum_seconds > 0)) {
+                fprintf(stderr, "%s: invalid time -- '%s'\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+          default:
+            return 1;
+        }
+    }
+
+    atexit(free_line_buffer);
+    puts("mode\tdistribution\tbytes\tpaths\tGB/s\tMpaths/s");
+
+    for (mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++) {
+        for (distribution = 0;
+          distribution < sizeof(distributions) / sizeof(distributions[0]);
+          distribution++) {
+            list_size = generate_list(&list, modes[mode].delimation, size,
+                distributions[distribution].minimum,
+                distributions[distribution].maximum);
+
+            // Tokenize the list repeatedly until enough time has passed for
+            // the measurement to be stable.
+            paths = 0;
+            rounds = 0;
+            start = monotonic_us();
+            do {
+                if (!(stream = fmemopen(list, list_size, "r"))) {
+                    perror("fmemopen");
+                    return 1;
+                }
+                while (read_path(stream, modes[mode].delimation)) {
+                    paths++;
+                }
+                fclose(stream);
+                rounds++;
+                elapsed = monotonic_us() - start;
+            } while (elapsed < minimum_seconds * 1e6);
+
+            printf("%s\t%s\t%zu\t%zu\t%.3f\t%.3f\n", modes[mode].option,
+                distributions[distribution].name, list_size * rounds, paths,
+                list_size * rounds / (elapsed * 1e3), paths / (double) elapsed);
+            fflush(stdout);
+            free(list);
+        }
+    }
+
+    return 0;
+}
@@ -7,109 +7,4629 @@
 #define _POSIX_C_SOURCE 200809L
 #endif
 
+// wait4(2), which is used to collect the resource usage of each child, is not
+// part of POSIX.
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#ifndef _DARWIN_C_SOURCE
+#define _DARWIN_C_SOURCE
+#endif
+
+// splice(2) and F_SETPIPE_SZ, which are used to feed the beginning of files to
+// children with "--head", and the CPU affinity functions are Linux extensions.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * Ways of handling file name delimation.
+ */
+typedef enum {
+    LINE_DELIMATION,
+    NULL_BYTE_DELIMATION,
+    ASCII_WHITESPACE_DELIMATION,
+} delimation_et;
+
+/**
+ * A child running the COMMAND. The PID is 0 when the slot is free.
+ */
+typedef struct {
+    pid_t pid;
+    // Path of the file being processed and the size of the buffer holding it.
+    char *path;
+    size_t path_capacity;
+    // Time the child was spawned, when its span starts and the copy of its
+    // path used by spans.
+    long long start;
+    long long span_start;
+    size_t path_offset;
+    // Position of the path in the input for the journal.
+    unsigned long long sequence;
+    // Indicates whether "--watch" has looked at the file again since the
+    // child was spawned, in which case its result is out of date.
+    int stale;
+    // State of a predicate chain: the file, which is rewound for every
+    // COMMAND, its size for "-t", the COMMAND that is running, the query and
+    // the group of COMMANDs joined by "--and" being evaluated or -1, the
+    // groups of the query that failed, the COMMANDs of the group that
+    // succeeded, the time spent on the group so far and a bit for each query
+    // that succeeded.
+    int input_fd;
+    long long size;
+    int predicate;
+    int query;
+    int group;
+    unsigned long long groups_done;
+    unsigned long long predicates_done;
+    long long group_cost;
+    unsigned long long verdicts;
+} slot_st;
+
+/**
+ * A COMMAND of a predicate chain: the position of its first argument after the
+ * options, whether its exit status is negated, and how many times it ran, how
+ * many of those times it succeeded after negation and the total number of
+ * microseconds it ran for.
+ */
+typedef struct {
+    size_t offset;
+    int negated;
+    unsigned long long runs;
+    unsigned long long passes;
+    long long cost;
+} predicate_st;
+
+/**
+ * A group of consecutive COMMANDs of a predicate chain joined by "--and",
+ * along with how many times it was evaluated, how many of those times it
+ * succeeded and the total number of microseconds spent evaluating it.
+ */
+typedef struct {
+    size_t first;
+    size_t count;
+    unsigned long long runs;
+    unsigned long long passes;
+    long long cost;
+} predicate_group_st;
+
+/**
+ * Token bucket used to limit a rate. The rate is 0 when there is no limit.
+ */
+typedef struct {
+    // Tokens earned per second, the most tokens the bucket can hold, the
+    // tokens currently held, which can be negative, and when the number of
+    // tokens was last updated.
+    double rate;
+    double capacity;
+    double tokens;
+    long long updated;
+} bucket_st;
+
+/**
+ * Result recorded in the journal for the path at a position of the input.
+ * The verdict is 's' when the COMMAND succeeded and 'f' when it failed.
+ */
+typedef struct {
+    unsigned long long sequence;
+    unsigned long long hash;
+    char verdict;
+} journal_entry_st;
+
+/**
+ * A path read by the coordinator of "--serve" whose result has not been
+ * reported yet.
+ */
+typedef struct {
+    unsigned long long sequence;
+    char *path;
+    // Identifier of the worker the path was handed to or 0 if it has not been
+    // handed out, and the verdict the worker sent back or 0 while there is
+    // none: 's' for success, 'f' for failure, 'e' for errors, described by
+    // "error", and 'k' for skipped files.
+    unsigned long worker;
+    char verdict;
+    char *error;
+} work_item_st;
+
+/**
+ * A worker connected to the coordinator of "--serve".
+ */
+typedef struct {
+    int fd;
+    unsigned long id;
+    // Indicates whether the worker asked for paths and has not been sent any
+    // yet.
+    int waiting;
+    // Data received from the worker that has not been handled yet.
+    char *buffer;
+    size_t used;
+    size_t capacity;
+} worker_st;
+
+/**
+ * A path found by "--watch" that still has to be looked at, and whether it is
+ * a directory that has to be watched and listed.
+ */
+typedef struct {
+    char *path;
+    int directory;
+} watch_entry_st;
+
+void add_path_pattern(char **, const char *, int);
+int add_to_batch(const char *, unsigned long long);
+work_item_st *add_work_item(unsigned long long, const char *, int);
+void adjust_concurrency(void);
+long long batch_argument_limit(char **);
+int cgroup_cpu_limit(void);
+void check_concurrency(void);
+void check_exec_failure(void);
+void check_journal(void);
+void check_metrics(void);
+void check_progress(void);
+void claim_slot(slot_st *, pid_t, const char *, long long);
+int compare_batch_paths(const void *, const void *);
+int compare_journal_entries(const void *, const void *);
+void compile_path_patterns(void);
+int copy_bytes(int, int, long long);
+int cpu_count(void);
+char **expand_template(const char *, long long);
+char find_journal_entry(unsigned long long, const char *);
+work_item_st *find_work_item(unsigned long long);
+int first_predicate(slot_st *);
+void forget_watch_directory(const char *, delimation_et);
+void fputs_json(const char *, FILE *);
 void free_line_buffer(void);
+slot_st *free_slot(void);
+char *glob_to_regex(const char *);
+unsigned long long hash_path(const char *);
+int head_input(int);
+int in_shard(const char *);
+char *join_path(const char *, const char *);
+void journal_result(unsigned long long, const char *, int);
+int load_journal(const char *);
 int main(int, char **);
-void sigusr1_handler(int) __attribute__((noreturn));
+int matches_magic(int);
+long long monotonic_us(void);
+int next_predicate(slot_st *, int, long long);
+void observe_child(long long);
+int open_socket(const char *, int);
+int open_watch(const char *);
+int parse_ioprio(const char *);
+int parse_magic(const char *);
+int parse_predicates(char **, int);
+int parse_rlimit(const char *);
+int parse_shard(const char *);
+int parse_size(const char *, long long *);
+int passes_metadata_filters(const struct stat *);
+int passes_path_filters(const char *);
+int pick_predicate(slot_st *);
+int pin_cpu(int);
+int prepare_pinning(void);
+int prepare_template(char **);
+int pull_path(char **, unsigned long long *);
+int pull_watch_path(char **, delimation_et);
+void queue_watch_entry(char *, int);
+int rate_limited(void);
+int read_cpu_quota(const char *, const char *);
+char *read_path(FILE *, delimation_et);
+void read_watch_events(delimation_et);
+void refill_bucket(bucket_st *, long long);
+void remove_socket(void);
+void report_watch_match(const char *, int, delimation_et);
+int restrict_child(void);
+int run_batch(char **, int, int, delimation_et, int, int);
+double sample_pressure(long long);
+double sample_utilization(void);
+void scan_watch_directory(const char *);
+int send_all(int, const char *, size_t);
+void send_result(unsigned long long, const char *, const char *);
+int serve(delimation_et, int, int);
+void sigchld_handler(int);
+void sigusr1_handler(int);
+void sigusr2_handler(int);
+pid_t spawn_child(char **, int, int, int, int);
+void template_append(const char *, size_t);
+long long trace_clock(void);
+size_t trace_path(const char *);
+long long trace_span(const char *, long long, int, size_t);
 void usage(char *);
+void wait_for_signal(int);
+char **watch_match_entry(char **, size_t, const char *);
+void write_journal(void);
+void write_json_result(const char *, const char *, int, const int *, long long,
+  const struct rusage *, const char *);
+void write_metric_header(FILE *, const char *, const char *, const char *);
+void write_metrics(void);
+void write_progress(void);
+void write_trace(void);
+void *xrealloc(void *, size_t);
+char *xstrdup(const char *);
+
+extern char **environ;
 
 /**
- * Pointer to buffer used by getline(3) and getdelim(3).
+ * Pointer to buffer used by getline(3) and getdelim(3), its size, and the
+ * portion of the most recently read record that has not been tokenized yet.
  */
 static char *line = NULL;
+static size_t line_capacity = 0;
+static char *token_cursor = NULL;
+static char *token_end = NULL;
 
 /**
- * Ways of handling file name delimation.
+ * Identifiers for options that only have a long form.
+ */
+enum {
+    CHAIN_OPTION = 256,
+    CONNECT_OPTION,
+    EXCLUDE_OPTION,
+    EXCLUDE_REGEX_OPTION,
+    HEAD_OPTION,
+    INCLUDE_OPTION,
+    INCLUDE_REGEX_OPTION,
+    IOPRIO_OPTION,
+    JOURNAL_OPTION,
+    JSON_OPTION,
+    MAGIC_OPTION,
+    MAX_RATE_OPTION,
+    MAX_READ_RATE_OPTION,
+    METRICS_FILE_OPTION,
+    MODE_OPTION,
+    NEWER_OPTION,
+    NICE_OPTION,
+    NO_STAT_OPTION,
+    NO_STDIN_OPTION,
+    OUTPUT_OPTION,
+    PIN_CPUS_OPTION,
+    PROGRESS_OPTION,
+    RESUME_OPTION,
+    RLIMIT_OPTION,
+    SERVE_OPTION,
+    SHARD_OPTION,
+    SIZE_MAX_OPTION,
+    SIZE_MIN_OPTION,
+    TRACE_OPTION,
+    TRUNCATE_JOURNAL_OPTION,
+    TYPE_OPTION,
+    WATCH_OPTION,
+};
+
+/**
+ * Long options accepted by getopt_long(3).
+ */
+static const struct option long_options[] = {
+    {"chain", no_argument, NULL, CHAIN_OPTION},
+    {"connect", required_argument, NULL, CONNECT_OPTION},
+    {"exclude", required_argument, NULL, EXCLUDE_OPTION},
+    {"exclude-regex", required_argument, NULL, EXCLUDE_REGEX_OPTION},
+    {"head", required_argument, NULL, HEAD_OPTION},
+    {"include", required_argument, NULL, INCLUDE_OPTION},
+    {"include-regex", required_argument, NULL, INCLUDE_REGEX_OPTION},
+    {"ioprio", required_argument, NULL, IOPRIO_OPTION},
+    {"journal", required_argument, NULL, JOURNAL_OPTION},
+    {"json", no_argument, NULL, JSON_OPTION},
+    {"magic", required_argument, NULL, MAGIC_OPTION},
+    {"max-rate", required_argument, NULL, MAX_RATE_OPTION},
+    {"max-read-rate", required_argument, NULL, MAX_READ_RATE_OPTION},
+    {"metrics-file", required_argument, NULL, METRICS_FILE_OPTION},
+    {"mode", required_argument, NULL, MODE_OPTION},
+    {"newer", required_argument, NULL, NEWER_OPTION},
+    {"nice", required_argument, NULL, NICE_OPTION},
+    {"no-stat", no_argument, NULL, NO_STAT_OPTION},
+    {"no-stdin", no_argument, NULL, NO_STDIN_OPTION},
+    {"output", required_argument, NULL, OUTPUT_OPTION},
+    {"pin-cpus", no_argument, NULL, PIN_CPUS_OPTION},
+    {"progress", required_argument, NULL, PROGRESS_OPTION},
+    {"resume", no_argument, NULL, RESUME_OPTION},
+    {"rlimit", required_argument, NULL, RLIMIT_OPTION},
+    {"serve", required_argument, NULL, SERVE_OPTION},
+    {"shard", required_argument, NULL, SHARD_OPTION},
+    {"size-max", required_argument, NULL, SIZE_MAX_OPTION},
+    {"size-min", required_argument, NULL, SIZE_MIN_OPTION},
+    {"trace", required_argument, NULL, TRACE_OPTION},
+    {"truncate-journal", no_argument, NULL, TRUNCATE_JOURNAL_OPTION},
+    {"type", required_argument, NULL, TYPE_OPTION},
+    {"watch", required_argument, NULL, WATCH_OPTION},
+    {NULL, 0, NULL, 0},
+};
+
+/**
+ * Counters describing the work done so far.
+ */
+typedef struct {
+    // Time the program started processing input.
+    long long start;
+    // Number of files whose processing has finished, how many of those were
+    // displayed, how many could not be queried because of an error and how
+    // many were rejected by filters without running the COMMAND.
+    unsigned long long files;
+    unsigned long long matches;
+    unsigned long long errors;
+    unsigned long long skipped;
+    // Number of times a child could not be created.
+    unsigned long long spawn_failures;
+    // Number of bytes of input consumed so far and the total size of the input
+    // or -1 if it is not known.
+    long long input_bytes;
+    long long input_size;
+} stats_st;
+
+static stats_st stats = {0, 0, 0, 0, 0, 0, 0, -1};
+
+/**
+ * Extended regular expressions that combine every include and exclude pattern
+ * into a single alternation while options are being parsed, and the compiled
+ * forms used to screen paths before they are opened. A path is only queried
+ * if it matches the include expression, when there is one, and does not match
+ * the exclude expression.
+ */
+static char *include_pattern = NULL;
+static char *exclude_pattern = NULL;
+static regex_t include_regex;
+static regex_t exclude_regex;
+
+/**
+ * Filters evaluated against the status of each file before a child is
+ * spawned. Sizes of -1 and a NULL type list mean there is no limit. The mode
+ * filter kind is '=' when the permission bits must match exactly, '-' when
+ * all of the bits must be set, '/' when any of the bits must be set and '\0'
+ * when permissions are not checked.
+ */
+static long long size_minimum = -1;
+static long long size_maximum = -1;
+static int newer_filter = 0;
+static struct timespec newer_than;
+static char mode_filter_kind = '\0';
+static mode_t mode_filter;
+static const char *type_filter = NULL;
+
+/**
+ * Maximum number of bytes of each file given to the COMMAND with "--head" or
+ * -1 when the COMMAND gets the whole file.
+ */
+static long long head_limit = -1;
+
+/**
+ * Shard of the input processed with "--shard" counting from 0 and the number
+ * of shards, or 0 when every path is processed.
+ */
+static unsigned long long shard_index = 0;
+static unsigned long long shard_count = 0;
+
+/**
+ * Paths collected for the next invocation of the COMMAND in batch mode. The
+ * paths are stored back to back with their null terminators in
+ * "batch_buffer", and "batch_size" tracks how many bytes they add to the
+ * argument list so that it stays under "batch_limit".
+ */
+static char *batch_buffer = NULL;
+static size_t batch_buffer_used = 0;
+static size_t batch_buffer_capacity = 0;
+static size_t *batch_offsets = NULL;
+static unsigned long long *batch_sequences = NULL;
+static size_t batch_count = 0;
+static size_t batch_capacity = 0;
+static long long batch_size = 0;
+static long long batch_limit;
+
+/**
+ * Path of the journal written with "--journal", its descriptor or -1 when
+ * there is none, the records that have not been written to it yet and when
+ * they are due to be written.
+ */
+static const char *journal_path = NULL;
+static int journal_fd = -1;
+static char journal_buffer[65536];
+static size_t journal_used = 0;
+static long long journal_due;
+
+/**
+ * Number of microseconds buffered journal records may wait before they are
+ * written, and the longest a record can be.
+ */
+#define JOURNAL_INTERVAL 1000000LL
+#define JOURNAL_RECORD_MAX 64
+
+/**
+ * Results read from the journal for "--resume", sorted by sequence number and
+ * path hash.
+ */
+static journal_entry_st *journal_entries = NULL;
+static size_t journal_entry_count = 0;
+
+/**
+ * Path of the UNIX domain socket the coordinator listens on with "--serve"
+ * and workers connect to with "--connect".
+ */
+static const char *socket_path = NULL;
+
+/**
+ * Number of paths the coordinator hands to a worker at once.
+ */
+#define SERVE_BATCH 32
+
+/**
+ * Paths read by the coordinator that have not been reported yet, in input
+ * order starting at "work_head".
+ */
+static work_item_st *work = NULL;
+static size_t work_head = 0;
+static size_t work_count = 0;
+static size_t work_capacity = 0;
+
+/**
+ * Socket a worker receives paths from or -1 when query is not a worker, the
+ * data received on it, how much of the data has been used, whether another
+ * batch has been asked for and how many paths of the current batch have been
+ * taken.
+ */
+static int worker_fd = -1;
+static char *worker_buffer = NULL;
+static size_t worker_buffer_used = 0;
+static size_t worker_buffer_offset = 0;
+static size_t worker_buffer_capacity = 0;
+static int worker_requested = 0;
+static size_t worker_batch_paths = 0;
+
+/**
+ * Events of inotify(7) that "--watch" subscribes to for every directory, and
+ * the number of paths taken from the queue between checks for new events.
+ */
+#ifdef __linux__
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+    IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+#endif
+#define WATCH_POLL_PATHS 4096
+
+/**
+ * Directory given to "--watch", the inotify(7) descriptor or -1 when query is
+ * not watching, the watched directories indexed by watch descriptor and how
+ * many there are, the paths that still have to be looked at starting at
+ * "watch_queue_head", the paths taken since events were last checked and the
+ * path most recently returned by "pull_watch_path".
+ */
+static char *watch_root = NULL;
+static int watch_fd = -1;
+static char **watch_directories = NULL;
+static size_t watch_directory_capacity = 0;
+static size_t watch_directory_count = 0;
+static watch_entry_st *watch_queue = NULL;
+static size_t watch_queue_head = 0;
+static size_t watch_queue_count = 0;
+static size_t watch_queue_capacity = 0;
+static size_t watch_polled = 0;
+static char *watch_path = NULL;
+
+/**
+ * Match set of "--watch" as an open addressing hash table of paths whose size
+ * is a power of two, the number of paths in it and the number of entries in
+ * use, which includes entries of removed paths that point to
+ * "watch_removed".
+ */
+static char **watch_matches = NULL;
+static size_t watch_match_capacity = 0;
+static size_t watch_match_count = 0;
+static size_t watch_match_used = 0;
+static char watch_removed[1];
+
+/**
+ * Placeholders that "-t" substitutes in the arguments of the COMMAND with the
+ * path of the file, its basename, its dirname, the path and the basename
+ * without the extension, and the size of the file.
  */
 typedef enum {
-    LINE_DELIMATION,
-    NULL_BYTE_DELIMATION,
-    ASCII_WHITESPACE_DELIMATION,
-} delimation_et;
+    PATH_PLACEHOLDER,
+    BASENAME_PLACEHOLDER,
+    DIRNAME_PLACEHOLDER,
+    STEM_PLACEHOLDER,
+    BASENAME_STEM_PLACEHOLDER,
+    SIZE_PLACEHOLDER,
+    PLACEHOLDER_COUNT,
+} placeholder_et;
+
+static const char *placeholders[] = {
+    "{}", "{/}", "{//}", "{.}", "{/.}", "{size}",
+};
+
+/**
+ * Argument list of the COMMAND as given, the argument list passed to
+ * execvp(3) with "-t", the indexes of the arguments that contain
+ * placeholders and a buffer holding the substituted text of those arguments
+ * at the given offsets. Everything is allocated once and reused for every
+ * file.
+ */
+static char **template_command = NULL;
+static char **template_arguments = NULL;
+static size_t *template_indexes = NULL;
+static size_t template_count = 0;
+static size_t *template_offsets = NULL;
+static char *template_buffer = NULL;
+static size_t template_used = 0;
+static size_t template_capacity = 0;
+
+/**
+ * Highest number of COMMANDs in a predicate chain.
+ */
+#define MAXIMUM_PREDICATES 64
+
+/**
+ * COMMANDs of the predicate chain and the groups they form. Without
+ * "--chain", the chain is a single COMMAND.
+ */
+static predicate_st predicates[MAXIMUM_PREDICATES];
+static size_t predicate_count = 0;
+static predicate_group_st predicate_groups[MAXIMUM_PREDICATES];
+static size_t group_count = 0;
+
+/**
+ * Queries separated by "--next" for fan-out mode, given as the index of their
+ * first group and the number of groups, and the files given with "--output"
+ * that the names of the files each query matches are written to, which are
+ * only opened once the options have been checked.
+ */
+static struct {
+    size_t first;
+    size_t count;
+} queries[MAXIMUM_PREDICATES];
+static size_t query_count = 0;
+static const char *query_output_paths[MAXIMUM_PREDICATES];
+static FILE *query_outputs[MAXIMUM_PREDICATES];
+static size_t query_output_count = 0;
+
+/**
+ * Byte sequence that must appear at an offset in a file for "--magic".
+ */
+typedef struct {
+    off_t offset;
+    unsigned char *bytes;
+    size_t length;
+} magic_st;
+
+/**
+ * Largest region of a file read at once for "--magic". Signatures further
+ * apart are read separately so distant offsets do not turn into huge reads.
+ */
+#define MAGIC_SPAN 65536
+
+/**
+ * Signatures given with "--magic" sorted by offset, a buffer the regions of
+ * the file that cover them are read into and its size.
+ */
+static magic_st *magics = NULL;
+static size_t magic_count = 0;
+static unsigned char *magic_buffer = NULL;
+static size_t magic_buffer_size = MAGIC_SPAN;
+
+/**
+ * Upper bounds in seconds of the buckets of the histogram of COMMAND run times
+ * exported with "--metrics-file" and the number of observations that fell
+ * into each bucket. The last count is for the implicit "+Inf" bucket.
+ */
+static const double child_duration_buckets[] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30,
+    60, 300,
+};
+
+#define CHILD_DURATION_BUCKETS \
+    (sizeof(child_duration_buckets) / sizeof(child_duration_buckets[0]))
+
+static unsigned long long child_duration_counts[CHILD_DURATION_BUCKETS + 1];
+static long long child_duration_sum = 0;
+
+/**
+ * Path of the Prometheus text file written by "--metrics-file", the temporary
+ * file it is written to before being renamed over the final path so readers
+ * never see a partial file, and when the file should next be rewritten.
+ */
+static const char *metrics_path = NULL;
+static char *metrics_temporary_path = NULL;
+static long long metrics_due;
+
+/**
+ * Number of microseconds between updates of the metrics file.
+ */
+#define METRICS_INTERVAL 5000000LL
+
+/**
+ * Slots for the children that may run at once, how many children are running
+ * and the current and highest limits on that number, which is -1 until it is
+ * known when "-j" is not given. The current limit only changes with
+ * "-j auto".
+ */
+static slot_st *slots = NULL;
+static int running_children = 0;
+static int jobs = -1;
+static int maximum_jobs;
+
+/**
+ * Token buckets for "--max-rate", charged a token for every child, and
+ * "--max-read-rate", charged a token for every byte the COMMAND can read from
+ * a file, and when the limits will next allow a file to be dispatched or -1
+ * if they do not currently apply.
+ */
+static bucket_st spawn_bucket = {0, 0, 0, 0};
+static bucket_st read_bucket = {0, 0, 0, 0};
+static long long rate_due = -1;
+
+/**
+ * Resources that can be limited with "--rlimit".
+ */
+static const struct {
+    const char *name;
+    int resource;
+} resources[] = {
+    {"as", RLIMIT_AS},
+    {"core", RLIMIT_CORE},
+    {"cpu", RLIMIT_CPU},
+    {"data", RLIMIT_DATA},
+    {"fsize", RLIMIT_FSIZE},
+    {"nofile", RLIMIT_NOFILE},
+    {"stack", RLIMIT_STACK},
+};
+
+#define RESOURCE_COUNT (sizeof(resources) / sizeof(resources[0]))
+
+/**
+ * Limits applied to children for each of the "resources", whether each limit
+ * was given, the niceness increment of children and their IO priority in the
+ * form expected by ioprio_set(2) or -1 to leave it alone.
+ */
+static struct rlimit child_limits[RESOURCE_COUNT];
+static int child_limit_set[RESOURCE_COUNT];
+static int child_nice = 0;
+static int child_ioprio = -1;
+
+/**
+ * Constants for ioprio_set(2), which has no wrapper in the C library.
+ */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+/**
+ * CPUs the children of each slot are pinned to with "--pin-cpus".
+ */
+static int *pinned_cpus = NULL;
+static int pinned_cpu_count = 0;
+
+/**
+ * State of the controller behind "-j auto": whether it is enabled, when the
+ * limit should next be adjusted, the time and file count of the previous
+ * adjustment, the throughput measured then and the change that was made,
+ * whether the limit is still doubling and whether every slot was busy at some
+ * point since the previous adjustment.
+ */
+static int auto_jobs = 0;
+static long long control_due;
+static long long control_previous_time;
+static unsigned long long control_previous_files = 0;
+static double control_rate = 0;
+static int control_step = 0;
+static int control_slow_start = 1;
+static int control_saturated = 0;
+
+/**
+ * Highest number of children that may run at once.
+ */
+#define MAXIMUM_JOBS 4096
+
+/**
+ * Number of microseconds between adjustments of the limit on children.
+ */
+#define CONTROL_INTERVAL 1000000LL
+
+/**
+ * Fraction of time some tasks may spend stalled on a resource before the limit
+ * on children is lowered, and the fraction of CPU time spent doing work above
+ * which it is not raised.
+ */
+#define PRESSURE_LIMIT 0.2
+#define UTILIZATION_LIMIT 0.95
+
+/**
+ * Pressure stall information files and the total stall times read from them
+ * at the previous adjustment, or -1 when they are unavailable, along with the
+ * busy and total CPU times from /proc/stat.
+ */
+#define PRESSURE_RESOURCES 3
+
+static const char *pressure_paths[PRESSURE_RESOURCES] = {
+    "/proc/pressure/cpu", "/proc/pressure/io", "/proc/pressure/memory",
+};
+
+static long long control_stall[PRESSURE_RESOURCES] = {-1, -1, -1};
+static long long control_cpu_busy = -1;
+static long long control_cpu_total = -1;
+
+/**
+ * Set by the SIGUSR2 handler to request a progress report.
+ */
+static volatile sig_atomic_t progress_requested = 0;
+
+/**
+ * Set by the SIGUSR1 handler when a child could not run the COMMAND.
+ */
+static volatile sig_atomic_t exec_failed = 0;
+
+/**
+ * Number of microseconds between progress reports or 0 if reports are only
+ * written on demand, when the next report is due, and the number of files that
+ * had been processed at the time of the previous report.
+ */
+static long long progress_interval = 0;
+static long long progress_due;
+static long long progress_previous_time;
+static unsigned long long progress_previous_files = 0;
+
+/**
+ * Signal mask used while the parent is waiting. Signals handled by the parent
+ * are blocked at all other times so that no system call needs to handle EINTR
+ * and handlers never interrupt the parent in the middle of its work. The mask
+ * the program started with is restored in children.
+ */
+static sigset_t wait_mask;
+static sigset_t original_mask;
+
+/**
+ * Value passed to "trace_span" in place of an offset into "trace_paths" when a
+ * span is not associated with a particular file.
+ */
+#define NO_TRACE_PATH ((size_t) -1)
+
+/**
+ * A complete span recorded for the Trace Event Format output of "--trace".
+ * Spans with a slot of -1 belong to the parent process.
+ */
+typedef struct {
+    const char *name;
+    long long start;
+    long long duration;
+    int slot;
+    size_t path_offset;
+} trace_event_st;
+
+/**
+ * Stream the trace is written to when the program exits. This is NULL when
+ * tracing is disabled.
+ */
+static FILE *trace_file = NULL;
+
+/**
+ * Spans recorded so far. They are kept in memory so that tracing does not add
+ * any I/O to the main loop.
+ */
+static trace_event_st *trace_events = NULL;
+static size_t trace_event_count = 0;
+static size_t trace_event_capacity = 0;
+
+/**
+ * Null-terminated copies of the paths referenced by "trace_events".
+ */
+static char *trace_paths = NULL;
+static size_t trace_paths_length = 0;
+static size_t trace_paths_capacity = 0;
+
+/**
+ * Highest slot number that has appeared in a span.
+ */
+static int trace_max_slot = -1;
+
 
 /**
  * Display application usage information.
  *
- * @param self  Name or path of compiled executable.
+ * @param self  Name or path of compiled executable.
+ */
+void usage(char *self)
+{
+    printf(
+        "Usage: %s [OPTION] [!] COMMAND [ARGUMENT...]\n"
+        "       %s [OPTION] --serve SOCKET\n"
+        "\n"
+        "This tool reads a list of files from stdin, pipes the contents of "
+        "each file\ninto the specified command and prints the name of the "
+        "file if the command\nsucceeds. The name of the file is exposed to "
+        "the command via the environment\nvariable QUERY_FILENAME.\n"
+        "\n"
+        "Option parsing stops at the first non-option argument. With "
+        "--chain, COMMANDs\ncan be combined with --and and --or, which bind "
+        "in that order, and negated with\n\"!\" after either of them. "
+        "COMMANDs joined by --and are reordered at runtime so\nthe cheapest "
+        "and most selective one runs first. Queries separated by --next all"
+        "\nrun on every file. A literal --and, --or or --next is written as "
+        "\\--and, \\--or\nor \\--next.\n"
+        "\n"
+        "Exit statuses:\n"
+        " 1     Fatal error encountered.\n"
+        " 2     Non-fatal error encountered.\n"
+        "\n"
+        "Options:\n"
+        " -!            Only print filenames when the COMMAND fails.\n"
+        " -0            File names are delimited by null bytes. Every printed "
+        "name,\n"
+        "               including the last, is followed by a null byte.\n"
+        " -h            Show this text and exit.\n"
+        " -j JOBS       Run up to JOBS children at once, or one per CPU when "
+        "JOBS is 0.\n"
+        "               With \"auto\", the number is adjusted at runtime "
+        "from throughput,\n"
+        "               CPU utilization and pressure stall information. "
+        "Defaults to one\n"
+        "               per CPU. Results are printed as children exit, so "
+        "use -j 1 to\n"
+        "               print them in input order.\n"
+        " -n            File names are line-delimited. This the default "
+        "behavior.\n"
+        " -s            Redirect stderr from the COMMAND to /dev/null.\n"
+        " -t            Substitute {} with the path, {/} with the basename, "
+        "{//} with the\n"
+        "               dirname, {.} and {/.} with the path and basename "
+        "without the\n"
+        "               extension and {size} with the size of the file in the "
+        "COMMAND\n"
+        "               arguments.\n"
+        " -w            File names are delimited by ASCII whitespace.\n"
+        " -X            Run the COMMAND with as many paths as fit in its "
+        "arguments. Paths\n"
+        "               printed by the COMMAND to stdout are treated as "
+        "successes. Implies\n"
+        "               --no-stdin.\n"
+        " --chain       Treat --and, --or and --next in the arguments as "
+        "separators of\n"
+        "               COMMANDs.\n"
+        " --connect SOCKET\n"
+        "               Work for the coordinator listening on SOCKET: take "
+        "paths from it\n"
+        "               instead of stdin and send the results back to it.\n"
+        " --exclude GLOB\n"
+        "               Skip paths matching the shell pattern GLOB before "
+        "opening them.\n"
+        "               Unlike filename expansion, \"*\" and \"?\" also "
+        "match \"/\".\n"
+        " --exclude-regex REGEX\n"
+        "               Skip paths matching the extended regular expression "
+        "REGEX.\n"
+        " --head BYTES  Only give the first BYTES bytes of each file to the "
+        "COMMAND. BYTES\n"
+        "               may have a K, M, G or T suffix for powers of 1024.\n"
+        " --include GLOB\n"
+        "               Skip paths that do not match any of the include "
+        "patterns.\n"
+        " --include-regex REGEX\n"
+        "               Like --include with an extended regular expression.\n"
+        " --ioprio CLASS\n"
+        "               Run children in the \"idle\" or "
+        "\"best-effort[:LEVEL]\" IO\n"
+        "               scheduling class. Only supported on Linux.\n"
+        " --journal FILE\n"
+        "               Record the result of every file in FILE. A "
+        "non-empty FILE is\n"
+        "               only used with --resume or --truncate-journal.\n"
+        " --json        Write one line of JSON describing the result of each "
+        "file to\n"
+        "               stdout instead of printing file names.\n"
+        " --magic OFFSET:HEX\n"
+        "               Skip files that do not contain the bytes given in "
+        "hexadecimal at\n"
+        "               OFFSET. When used more than once, files matching any "
+        "of the\n"
+        "               signatures are queried.\n"
+        " --max-rate N  Start at most N children per second.\n"
+        " --max-read-rate BYTES\n"
+        "               Dispatch files at a rate of at most BYTES bytes per "
+        "second based\n"
+        "               on their sizes. BYTES may have a K, M, G or T "
+        "suffix.\n"
+        " --metrics-file PATH\n"
+        "               Export counters, gauges and a histogram of COMMAND run "
+        "times in\n"
+        "               the Prometheus text format by atomically rewriting "
+        "PATH every\n"
+        "               few seconds.\n"
+        " --mode MODE   Skip files whose permission bits are not exactly "
+        "the octal\n"
+        "               MODE. With a \"-\" prefix, skip files that do not "
+        "have all of\n"
+        "               the bits set, and with a \"/\" prefix, skip files that "
+        "have\n"
+        "               none of them set.\n"
+        " --newer FILE  Skip files that were not modified more recently than "
+        "FILE.\n"
+        " --nice N      Add N to the niceness of children.\n"
+        " --no-stat     Like --no-stdin without checking whether the path is "
+        "a\n"
+        "               directory. Cannot be combined with filters that need "
+        "the status\n"
+        "               of the file.\n"
+        " --no-stdin    Do not open files. The stdin of the COMMAND is "
+        "/dev/null and\n"
+        "               stat(2) is used to check for directories and apply "
+        "filters.\n"
+        " --output FILE Write the names of the files matched by a query "
+        "separated by --next\n"
+        "               to FILE. Needed once for every query, in order.\n"
+        " --pin-cpus    Pin the children of each slot to a different CPU "
+        "of the affinity\n"
+        "               mask of query. Only supported on Linux.\n"
+        " --progress SECONDS\n"
+        "               Write a progress report to stderr every SECONDS "
+        "seconds. A\n"
+        "               report is also written whenever SIGUSR2 is received.\n"
+        " --resume      Report the results in the --journal FILE of an earlier "
+        "run again\n"
+        "               and only query the remaining files.\n"
+        " --rlimit NAME=VALUE\n"
+        "               Limit the as, core, cpu, data, fsize, nofile or stack "
+        "resource of\n"
+        "               children like setrlimit(2). VALUE may have a K, M, G "
+        "or T suffix\n"
+        "               or be \"unlimited\".\n"
+        " --serve SOCKET\n"
+        "               Coordinate workers started with --connect SOCKET "
+        "instead of\n"
+        "               running a COMMAND: hand out the input in batches and "
+        "print the\n"
+        "               results in input order.\n"
+        " --shard K/N   Only process the paths in shard K of N, e.g. to "
+        "split the same\n"
+        "               input between N instances of query.\n"
+        " --size-max SIZE\n"
+        "               Skip files larger than SIZE bytes. SIZE may have a "
+        "K, M, G or T\n"
+        "               suffix for powers of 1024.\n"
+        " --size-min SIZE\n"
+        "               Skip files smaller than SIZE bytes.\n"
+        " --trace FILE  Write a Trace Event Format (Chrome, Perfetto) JSON "
+        "trace of\n"
+        "               the work done for each file to FILE on exit.\n"
+        " --truncate-journal\n"
+        "               Discard the results in a non-empty --journal FILE "
+        "instead of\n"
+        "               refusing to start.\n"
+        " --type TYPES  Skip files whose type is not one of the TYPES: f "
+        "(regular\n"
+        "               file), p (FIFO), c (character device), b (block "
+        "device) or s\n"
+        "               (socket).\n"
+        " --watch DIR   Query the files under DIR instead of reading paths "
+        "from stdin,\n"
+        "               then keep querying files as they are written and "
+        "print matches\n"
+        "               as \"+PATH\" and files that stop matching as "
+        "\"-PATH\". Only\n"
+        "               supported on Linux.\n"
+        , self, self
+    );
+}
+
+/**
+ * Free memory allocated for getline(3) and getdelim(3).
+ */
+void free_line_buffer(void)
+{
+    free(line);
+}
+
+/**
+ * Read the next path from a stream. Empty records are skipped.
+ *
+ * @param stream      Stream containing the list of paths.
+ * @param delimation  Way paths in the stream are delimited.
+ *
+ * @return Pointer to the null-terminated path or NULL once the stream has been
+ * exhausted. The path is only valid until the next call. If the stream cannot
+ * be read, the program exits with a status of 1.
+ */
+char *read_path(FILE *stream, delimation_et delimation)
+{
+    char *cursor;
+    ssize_t line_length;
+    char *path;
+    long long span_start;
+
+    while (1) {
+        if (delimation == ASCII_WHITESPACE_DELIMATION) {
+            // Move the cursor to the beginning of the next word then past its
+            // end so the following call resumes after it.
+            while (token_cursor < token_end && !(*token_cursor)) {
+                token_cursor++;
+            }
+            if (token_cursor < token_end) {
+                path = token_cursor;
+                for (; *token_cursor; token_cursor++);
+                return path;
+            }
+        } else if (token_cursor < token_end) {
+            path = token_cursor;
+            token_cursor = token_end;
+            if (*path) {
+                return path;
+            }
+        }
+
+        span_start = trace_clock();
+        if (delimation == NULL_BYTE_DELIMATION) {
+            line_length = getdelim(&line, &line_capacity, (int) '\0', stream);
+        } else {
+            line_length = getline(&line, &line_capacity, stream);
+        }
+
+        if (line_length == -1) {
+            if (feof(stream)) {
+                return NULL;
+            }
+            perror(delimation == NULL_BYTE_DELIMATION ? "getdelim" : "getline");
+            exit(1);
+        }
+
+        token_cursor = line;
+        token_end = line + line_length;
+        stats.input_bytes += line_length;
+        trace_span("read-input", span_start, -1, NO_TRACE_PATH);
+
+        // When using line and whitespace delimation, insert null bytes so that
+        // a pointer to the beginning of the field can be used to represent the
+        // path of the file being opened.
+        if (delimation == LINE_DELIMATION) {
+            if (line[line_length - 1] == '\n') {
+                line[line_length - 1] = '\0';
+            }
+        } else if (delimation == ASCII_WHITESPACE_DELIMATION) {
+            for (cursor = line; cursor < token_end; cursor++) {
+                if (isspace(*cursor)) {
+                    *cursor = '\0';
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Translate a shell pattern into an anchored extended regular expression. The
+ * "*" and "?" wildcards also match "/" so a single pattern can match a
+ * directory name at any depth of a path.
+ *
+ * @param glob  Shell pattern.
+ *
+ * @return Newly allocated regular expression.
+ */
+char *glob_to_regex(const char *glob)
+{
+    const char *class;
+    const char *closing;
+    const char *cursor;
+    char *regex;
+    char *output;
+
+    // Every character expands to at most four in the output.
+    regex = xrealloc(NULL, strlen(glob) * 4 + 3);
+    output = regex;
+    *output++ = '^';
+
+    for (cursor = glob; *cursor; cursor++) {
+        switch (*cursor) {
+          case '*':
+            *output++ = '.';
+            *output++ = '*';
+            break;
+          case '?':
+            *output++ = '.';
+            break;
+          case '[':
+            // Copy bracket expressions as-is aside from translating the "!"
+            // negation. A "]" right after the opening bracket or negation or
+            // inside a "[:class:]", "[=equivalence=]" or "[.collating.]"
+            // element is part of the set, and an unterminated bracket is a
+            // literal.
+            closing = cursor + 1;
+            closing += *closing == '!' || *closing == '^';
+            closing += *closing == ']';
+            for (; *closing && *closing != ']'; closing++) {
+                if (*closing == '[' && closing[1] &&
+                  strchr(":=.", closing[1])) {
+                    for (class = closing + 2; *class && (class[0] !=
+                      closing[1] || class[1] != ']'); class++);
+                    closing = *class ? class + 1 : closing;
+                }
+            }
+            if (*closing) {
+                *output++ = '[';
+                cursor++;
+                if (*cursor == '!' || *cursor == '^') {
+                    *output++ = '^';
+                    cursor++;
+                }
+                for (; cursor <= closing; cursor++) {
+                    *output++ = *cursor;
+                }
+                cursor--;
+                break;
+            }
+            // fall through
+          default:
+            if (*cursor == '\\' && cursor[1]) {
+                cursor++;
+            }
+            if (*cursor == '^' || *cursor == '\\') {
+                *output++ = '\\';
+                *output++ = *cursor;
+            } else if (strchr(".[]()+{}|$*?", *cursor)) {
+                *output++ = '[';
+                *output++ = *cursor;
+                *output++ = ']';
+            } else {
+                *output++ = *cursor;
+            }
+        }
+    }
+
+    *output++ = '$';
+    *output = '\0';
+    return regex;
+}
+
+/**
+ * Add an extended regular expression to the alternation of include or exclude
+ * patterns. The program exits with a status of 1 if the expression is
+ * invalid.
+ *
+ * @param pattern  Alternation to add the expression to.
+ * @param regex    Expression to add.
+ * @param owned    Indicates whether the expression was allocated with malloc
+ *                 and should be freed.
+ */
+void add_path_pattern(char **pattern, const char *regex, int owned)
+{
+    char message[256];
+    regex_t compiled;
+    int error;
+    size_t length;
+
+    // Compiling the expression by itself gives a better error message than
+    // compiling the whole alternation later.
+    if ((error = regcomp(&compiled, regex, REG_EXTENDED | REG_NOSUB))) {
+        regerror(error, &compiled, message, sizeof(message));
+        fprintf(stderr, "%s: %s\n", regex, message);
+        exit(1);
+    }
+    regfree(&compiled);
+
+    length = *pattern ? strlen(*pattern) : 0;
+    *pattern = xrealloc(*pattern, length + strlen(regex) + 4);
+    sprintf(*pattern + length, "%s(%s)", length ? "|" : "", regex);
+
+    if (owned) {
+        free((char *) regex);
+    }
+}
+
+/**
+ * Compile the include and exclude alternations. The program exits with a
+ * status of 1 on failure.
+ */
+void compile_path_patterns(void)
+{
+    int error;
+    char message[256];
+
+    if (include_pattern && (error = regcomp(&include_regex, include_pattern,
+      REG_EXTENDED | REG_NOSUB))) {
+        regerror(error, &include_regex, message, sizeof(message));
+        fprintf(stderr, "--include: %s\n", message);
+        exit(1);
+    }
+
+    if (exclude_pattern && (error = regcomp(&exclude_regex, exclude_pattern,
+      REG_EXTENDED | REG_NOSUB))) {
+        regerror(error, &exclude_regex, message, sizeof(message));
+        fprintf(stderr, "--exclude: %s\n", message);
+        exit(1);
+    }
+}
+
+/**
+ * Check whether a path passes the include and exclude patterns.
+ *
+ * @param path  Path of the file.
+ *
+ * @return Non-zero if the file should be opened and queried.
+ */
+int passes_path_filters(const char *path)
+{
+    if (include_pattern && regexec(&include_regex, path, 0, NULL, 0)) {
+        return 0;
+    }
+
+    return !exclude_pattern || regexec(&exclude_regex, path, 0, NULL, 0);
+}
+
+/**
+ * Parse a signature for "--magic" and add it to the list of signatures.
+ *
+ * @param text  Offset in decimal, octal or hexadecimal followed by a colon and
+ *              the bytes of the signature in hexadecimal.
+ *
+ * @return 0 if the text was parsed successfully and -1 otherwise.
+ */
+int parse_magic(const char *text)
+{
+    char *cursor;
+    size_t index;
+    magic_st *magic;
+    long long offset;
+    char pair[3];
+
+    offset = strtoll(text, &cursor, 0);
+    if (cursor == text || *cursor != ':' || offset < 0) {
+        return -1;
+    }
+
+    cursor++;
+    if (!cursor[0] || strlen(cursor) % 2 ||
+      strspn(cursor, "0123456789abcdefABCDEF") != strlen(cursor)) {
+        return -1;
+    }
+
+    // Signatures are kept sorted by offset so nearby ones can share a read.
+    magics = xrealloc(magics, (magic_count + 1) * sizeof(*magics));
+    for (magic = &magics[magic_count++]; magic > magics &&
+      magic[-1].offset > (off_t) offset; magic--) {
+        magic[0] = magic[-1];
+    }
+    magic->offset = (off_t) offset;
+    magic->length = strlen(cursor) / 2;
+    magic->bytes = xrealloc(NULL, magic->length);
+
+    pair[2] = '\0';
+    for (index = 0; index < magic->length; index++) {
+        pair[0] = cursor[index * 2];
+        pair[1] = cursor[index * 2 + 1];
+        magic->bytes[index] = (unsigned char) strtol(pair, NULL, 16);
+    }
+
+    if (magic->length > magic_buffer_size) {
+        magic_buffer_size = magic->length;
+    }
+
+    return 0;
+}
+
+/**
+ * Check whether a file contains any of the "--magic" signatures. Signatures
+ * within MAGIC_SPAN bytes of each other are fetched with a single pread(2),
+ * so the usual case of signatures near the start of the file costs one small
+ * read. Files that cannot be read at an offset, like FIFOs, never match.
+ *
+ * @param fd  Descriptor of the file.
+ *
+ * @return Non-zero if a signature matched.
+ */
+int matches_magic(int fd)
+{
+    off_t end;
+    size_t first;
+    size_t index;
+    magic_st *magic;
+    ssize_t size;
+    off_t start;
+
+    if (!magic_buffer) {
+        magic_buffer = xrealloc(NULL, magic_buffer_size);
+    }
+
+    for (first = 0; first < magic_count; first = index) {
+        start = magics[first].offset;
+        end = start + (off_t) magics[first].length;
+        for (index = first + 1; index < magic_count &&
+          magics[index].offset + (off_t) magics[index].length - start <=
+          MAGIC_SPAN; index++) {
+            magic = &magics[index];
+            end = magic->offset + (off_t) magic->length > end ?
+                magic->offset + (off_t) magic->length : end;
+        }
+
+        if ((size = pread(fd, magic_buffer, (size_t) (end - start), start)) ==
+          -1) {
+            return 0;
+        }
+        for (magic = &magics[first]; magic < magics + index; magic++) {
+            if (magic->offset - start + (off_t) magic->length <= size &&
+              !memcmp(magic_buffer + (magic->offset - start), magic->bytes,
+              magic->length)) {
+                return 1;
+            }
+        }
+
+        // Later regions start further into the file, so a short read means
+        // none of them can match.
+        if (size < end - start) {
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Copy bytes from the current offset of one descriptor to another, stopping
+ * early at the end of the input.
+ *
+ * @param input_fd   Descriptor to read from.
+ * @param output_fd  Descriptor to write to.
+ * @param count      Maximum number of bytes to copy.
+ *
+ * @return 0 on success and -1 on failure with errno set.
+ */
+int copy_bytes(int input_fd, int output_fd, long long count)
+{
+    static char buffer[65536];
+    size_t chunk;
+    ssize_t length = 0;
+    ssize_t offset;
+    ssize_t written;
+
+#ifdef __linux__
+    // splice(2) moves the pages of the file into the pipe without copying
+    // them through user space, but it fails with EINVAL when neither end is a
+    // pipe or the file system does not support it.
+    while (count > 0 && (length = splice(input_fd, NULL, output_fd, NULL,
+      (size_t) count, 0)) > 0) {
+        count -= length;
+    }
+    if (count == 0 || length == 0) {
+        return 0;
+    } else if (errno != EINVAL) {
+        return -1;
+    }
+#endif
+
+    while (count > 0) {
+        chunk = count < (long long) sizeof(buffer) ? (size_t) count :
+            sizeof(buffer);
+        if ((length = read(input_fd, buffer, chunk)) <= 0) {
+            return (int) length;
+        }
+        count -= length;
+        for (offset = 0; offset < length; offset += written) {
+            if ((written = write(output_fd, buffer + offset,
+              (size_t) (length - offset))) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Copy the first "head_limit" bytes of a file into a pipe, or into a temporary
+ * file when a pipe cannot hold that many bytes, for use as the stdin of the
+ * COMMAND. The bytes are copied before the child is spawned so the parent
+ * never blocks on a child that stops reading early.
+ *
+ * @param fd  Descriptor of the file.
+ *
+ * @return Readable descriptor containing the bytes or -1 on failure with
+ * errno set.
+ */
+int head_input(int fd)
+{
+    long capacity;
+    int error_number;
+    int output_fd;
+    int pipe_fds[2];
+    FILE *temporary;
+
+    if (pipe(pipe_fds) == -1) {
+        return -1;
+    }
+
+#ifdef F_SETPIPE_SZ
+    // Growing the pipe fails when the limit is above
+    // /proc/sys/fs/pipe-max-size for unprivileged users, in which case the
+    // size is left alone.
+    if (head_limit > PIPE_BUF) {
+        fcntl(pipe_fds[1], F_SETPIPE_SZ,
+            (int) (head_limit < INT_MAX ? head_limit : INT_MAX));
+    }
+    capacity = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+#else
+    capacity = PIPE_BUF;
+#endif
+
+    // Every COMMAND of a predicate chain reads the file from the start, and a
+    // pipe cannot be rewound.
+    if (capacity >= head_limit && predicate_count < 2) {
+        if (copy_bytes(fd, pipe_fds[1], head_limit) == -1) {
+            error_number = errno;
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            errno = error_number;
+            return -1;
+        }
+        close(pipe_fds[1]);
+        return pipe_fds[0];
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    if (!(temporary = tmpfile())) {
+        return -1;
+    }
+    output_fd = dup(fileno(temporary));
+    fclose(temporary);
+
+    if (output_fd == -1) {
+        return -1;
+    } else if (copy_bytes(fd, output_fd, head_limit) == -1 ||
+      lseek(output_fd, 0, SEEK_SET) == -1) {
+        error_number = errno;
+        close(output_fd);
+        errno = error_number;
+        return -1;
+    }
+
+    return output_fd;
+}
+
+/**
+ * Compute how many bytes the paths of a batch may add to the argument list of
+ * the COMMAND. Like xargs(1), the sizes of the environment and the COMMAND
+ * and 2048 bytes of headroom are subtracted from ARG_MAX, and every argument
+ * also costs the size of its pointer in argv.
+ *
+ * @param command  Null-terminated argument list of the COMMAND.
+ *
+ * @return Number of bytes available for paths.
+ */
+long long batch_argument_limit(char **command)
+{
+    char **cursor;
+    long long limit;
+
+    limit = sysconf(_SC_ARG_MAX);
+    limit = (limit == -1 ? _POSIX_ARG_MAX : limit) - 2048;
+
+    for (cursor = environ; *cursor; cursor++) {
+        limit -= (long long) (strlen(*cursor) + 1 + sizeof(char *));
+    }
+    for (cursor = command; *cursor; cursor++) {
+        limit -= (long long) (strlen(*cursor) + 1 + sizeof(char *));
+    }
+
+    return limit;
+}
+
+/**
+ * Add a path to the batch for the next invocation of the COMMAND.
+ *
+ * @param path  Path of the file.
+ *
+ * @return 1 if the path was added or 0 if it would make the argument list too
+ * long. A path is always added to an empty batch.
+ */
+int add_to_batch(const char *path, unsigned long long sequence)
+{
+    size_t length;
+
+    length = strlen(path) + 1;
+    if (batch_count && batch_size + (long long) (length + sizeof(char *)) >
+      batch_limit) {
+        return 0;
+    }
+
+    if (batch_buffer_used + length > batch_buffer_capacity) {
+        batch_buffer_capacity = batch_buffer_capacity * 2 + length;
+        batch_buffer = xrealloc(batch_buffer, batch_buffer_capacity);
+    }
+    if (batch_count == batch_capacity) {
+        batch_capacity = batch_capacity ? batch_capacity * 2 : 256;
+        batch_offsets = xrealloc(batch_offsets,
+            batch_capacity * sizeof(*batch_offsets));
+        batch_sequences = xrealloc(batch_sequences,
+            batch_capacity * sizeof(*batch_sequences));
+    }
+
+    memcpy(batch_buffer + batch_buffer_used, path, length);
+    batch_sequences[batch_count] = sequence;
+    batch_offsets[batch_count++] = batch_buffer_used;
+    batch_buffer_used += length;
+    batch_size += (long long) (length + sizeof(char *));
+    return 1;
+}
+
+/**
+ * Comparison function for qsort(3) that sorts indexes into the batch by the
+ * paths they refer to.
+ */
+int compare_batch_paths(const void *a, const void *b)
+{
+    return strcmp(batch_buffer + batch_offsets[*(const size_t *) a],
+        batch_buffer + batch_offsets[*(const size_t *) b]);
+}
+
+/**
+ * Run the COMMAND once with every path in the batch appended to its arguments
+ * and report each file as matching when the COMMAND printed its path, then
+ * empty the batch. The exit status of the COMMAND is ignored unless it was
+ * killed by a signal, in which case every file in the batch is an error.
+ *
+ * @param command             Null-terminated argument list of the COMMAND.
+ * @param dev_null_fd         Descriptor for /dev/null used as stdin.
+ * @param errout_fd           Descriptor used as stderr.
+ * @param delimation          Way paths are delimited. With null byte
+ *                            delimation, the COMMAND must also delimit the
+ *                            paths it prints with null bytes.
+ * @param display_on_success  Indicates whether printed paths or the paths
+ *                            that were not printed are displayed.
+ * @param json_output         Indicates whether JSON records are written.
+ *
+ * @return 1 if any of the files could not be queried and 0 otherwise.
+ */
+int run_batch(char **command, int dev_null_fd, int errout_fd,
+  delimation_et delimation, int display_on_success, int json_output)
+{
+    static char *output = NULL;
+    static size_t output_capacity = 0;
+    char **arguments;
+    struct rusage child_usage;
+    size_t command_count;
+    char delimiter;
+    size_t high;
+    size_t index;
+    ssize_t length;
+    size_t low;
+    int match;
+    unsigned char *matched;
+    size_t middle;
+    int output_fds[2];
+    size_t output_used;
+    const char *path;
+    pid_t pid;
+    char *record;
+    char *record_end;
+    slot_st *slot;
+    size_t *sorted;
+    long long span_start;
+    long long spawn_time;
+    int status;
+    long long wall_us;
+
+    for (command_count = 0; command[command_count]; command_count++);
+    arguments = xrealloc(NULL,
+        (command_count + batch_count + 1) * sizeof(*arguments));
+    memcpy(arguments, command, command_count * sizeof(*arguments));
+    for (index = 0; index < batch_count; index++) {
+        arguments[command_count + index] = batch_buffer + batch_offsets[index];
+    }
+    arguments[command_count + batch_count] = NULL;
+
+    if (pipe(output_fds) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+
+    span_start = trace_clock();
+    spawn_time = monotonic_us();
+
+    switch ((pid = fork())) {
+      case -1:
+        perror("fork");
+        stats.spawn_failures++;
+        exit(1);
+
+      case 0:
+        if ((dup2(dev_null_fd, STDIN_FILENO) == -1) ||
+            (dup2(output_fds[1], STDOUT_FILENO) == -1) ||
+            (dup2(errout_fd, STDERR_FILENO) == -1)) {
+
+            perror("dup2");
+            kill(getppid(), SIGUSR1);
+            _exit(1);
+        } else if (restrict_child() == -1) {
+            kill(getppid(), SIGUSR1);
+            _exit(1);
+        }
+        close(output_fds[0]);
+        close(output_fds[1]);
+        sigprocmask(SIG_SETMASK, &original_mask, NULL);
+        execvp(arguments[0], arguments);
+        perror(arguments[0]);
+        kill(getppid(), SIGUSR1);
+        _exit(1);
+    }
+
+    close(output_fds[1]);
+    free(arguments);
+    slot = slots;
+    claim_slot(slot, pid, batch_buffer, spawn_time);
+    spawn_bucket.tokens--;
+    span_start = trace_span("spawn", span_start, -1, NO_TRACE_PATH);
+
+    // The output is read without blocking so that progress reports and
+    // metrics are still written while a long batch runs. At least one byte
+    // is always left free so the last record can be terminated.
+    fcntl(output_fds[0], F_SETFL, O_NONBLOCK);
+    output_used = 0;
+    while (1) {
+        if (output_capacity - output_used < 65536) {
+            output_capacity = output_capacity * 2 + 65536;
+            output = xrealloc(output, output_capacity);
+        }
+        length = read(output_fds[0], output + output_used,
+            output_capacity - output_used - 1);
+        if (length > 0) {
+            output_used += (size_t) length;
+        } else if (length == 0) {
+            break;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            wait_for_signal(output_fds[0]);
+        } else {
+            perror("read");
+            exit(1);
+        }
+    }
+    close(output_fds[0]);
+
+    while (1) {
+        if ((pid = wait4(-1, &status, WNOHANG, &child_usage)) == -1) {
+            perror("wait4");
+            exit(1);
+        } else if (pid == 0) {
+            wait_for_signal(-1);
+        } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            check_exec_failure();
+            break;
+        }
+    }
+
+    wall_us = monotonic_us() - spawn_time;
+    slot->pid = 0;
+    running_children--;
+    observe_child(wall_us);
+    span_start = trace_span("child", span_start, 0, NO_TRACE_PATH);
+
+    // Printed paths are looked up in a sorted copy of the batch so that lines
+    // that do not name a file in the batch can be reported.
+    matched = xrealloc(NULL, batch_count);
+    memset(matched, 0, batch_count);
+    sorted = xrealloc(NULL, batch_count * sizeof(*sorted));
+    for (index = 0; index < batch_count; index++) {
+        sorted[index] = index;
+    }
+    qsort(sorted, batch_count, sizeof(*sorted), compare_batch_paths);
+
+    delimiter = delimation == NULL_BYTE_DELIMATION ? '\0' : '\n';
+    if (output_used && output[output_used - 1] != delimiter) {
+        output[output_used++] = delimiter;
+    }
+
+    for (record = output; record < output + output_used;
+      record = record_end + 1) {
+        record_end = memchr(record, delimiter,
+            (size_t) (output + output_used - record));
+        *record_end = '\0';
+        if (record == record_end) {
+            continue;
+        }
+
+        for (low = 0, high = batch_count; low < high; ) {
+            middle = low + (high - low) / 2;
+            if (strcmp(batch_buffer + batch_offsets[sorted[middle]],
+              record) < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        if (low == batch_count ||
+          strcmp(batch_buffer + batch_offsets[sorted[low]], record)) {
+            fprintf(stderr, "%s: printed a path that is not in its batch -- "
+                "'%s'\n", command[0], record);
+        }
+        for (; low < batch_count &&
+          !strcmp(batch_buffer + batch_offsets[sorted[low]], record); low++) {
+            matched[sorted[low]] = 1;
+        }
+    }
+
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "%s: %s\n", command[0], strsignal(WTERMSIG(status)));
+    }
+
+    for (index = 0; index < batch_count; index++) {
+        path = batch_buffer + batch_offsets[index];
+        stats.files++;
+
+        if (WIFSIGNALED(status)) {
+            stats.errors++;
+            if (json_output) {
+                write_json_result(path, "error", 0, &status, wall_us,
+                    &child_usage, strsignal(WTERMSIG(status)));
+            }
+            continue;
+        }
+
+        match = matched[index] == display_on_success;
+        stats.matches += match;
+        journal_result(batch_sequences[index], path, matched[index]);
+        if (json_output) {
+            write_json_result(path, matched[index] ? "success" : "failure",
+                match, &status, wall_us, &child_usage, NULL);
+        } else if (match) {
+            fputs(path, stdout);
+            putchar(delimation == NULL_BYTE_DELIMATION ? '\0' : '\n');
+        }
+    }
+
+    trace_span("output", span_start, -1, NO_TRACE_PATH);
+    free(matched);
+    free(sorted);
+    batch_count = 0;
+    batch_buffer_used = 0;
+    batch_size = 0;
+    check_progress();
+    check_metrics();
+    return WIFSIGNALED(status) ? 1 : 0;
+}
+
+/**
+ * Remember the arguments of the COMMAND that contain placeholders for "-t".
+ *
+ * @param command  Null-terminated argument list of the COMMAND.
+ *
+ * @return Non-zero if the "{size}" placeholder is used.
+ */
+int prepare_template(char **command)
+{
+    size_t count;
+    size_t index;
+    size_t placeholder;
+    int uses_size;
+
+    for (count = 0; command[count]; count++);
+    template_command = command;
+    template_arguments = xrealloc(NULL, (count + 1) * sizeof(char *));
+    template_indexes = xrealloc(NULL, count * sizeof(size_t));
+    template_offsets = xrealloc(NULL, count * sizeof(size_t));
+    memcpy(template_arguments, command, (count + 1) * sizeof(char *));
+
+    uses_size = 0;
+    for (index = 0; index < count; index++) {
+        for (placeholder = 0; placeholder < PLACEHOLDER_COUNT; placeholder++) {
+            if (strstr(command[index], placeholders[placeholder])) {
+                template_indexes[template_count++] = index;
+                break;
+            }
+        }
+        uses_size |= strstr(command[index], "{size}") != NULL;
+    }
+
+    return uses_size;
+}
+
+/**
+ * Append text to the buffer of substituted arguments.
+ *
+ * @param text    Text to append.
+ * @param length  Number of bytes to append.
+ */
+void template_append(const char *text, size_t length)
+{
+    if (template_used + length > template_capacity) {
+        template_capacity = template_capacity * 2 + length;
+        template_buffer = xrealloc(template_buffer, template_capacity);
+    }
+    memcpy(template_buffer + template_used, text, length);
+    template_used += length;
+}
+
+/**
+ * Substitute the placeholders for "-t" in the arguments of the COMMAND. Only
+ * the arguments that contain placeholders are rebuilt; the rest of the
+ * argument list is reused as-is.
+ *
+ * @param path  Path of the file.
+ * @param size  Size of the file in bytes.
+ *
+ * @return Null-terminated argument list that is valid until the next call.
+ */
+char **expand_template(const char *path, long long size)
+{
+    const char *basename;
+    const char *cursor;
+    size_t dirname_length;
+    const char *extension;
+    size_t index;
+    size_t length;
+    size_t path_length;
+    size_t placeholder;
+    char size_text[32];
+
+    // The dirname of a path without slashes is "." and the dirname of a file
+    // in the root directory is "/". A leading dot, as in ".profile", does not
+    // start an extension.
+    path_length = strlen(path);
+    if ((basename = strrchr(path, '/'))) {
+        dirname_length = basename == path ? 1 : (size_t) (basename - path);
+        basename++;
+    } else {
+        basename = path;
+        dirname_length = 0;
+    }
+    if (!(extension = strrchr(basename, '.')) || extension == basename) {
+        extension = path + path_length;
+    }
+    snprintf(size_text, sizeof(size_text), "%lld", size);
+
+    template_used = 0;
+    for (index = 0; index < template_count; index++) {
+        template_offsets[index] = template_used;
+        for (cursor = template_command[template_indexes[index]]; *cursor; ) {
+            for (placeholder = 0; placeholder < PLACEHOLDER_COUNT;
+              placeholder++) {
+                length = strlen(placeholders[placeholder]);
+                if (!strncmp(cursor, placeholders[placeholder], length)) {
+                    break;
+                }
+            }
+
+            switch (placeholder) {
+              case PATH_PLACEHOLDER:
+                template_append(path, path_length);
+                break;
+              case BASENAME_PLACEHOLDER:
+                template_append(basename,
+                    (size_t) (path + path_length - basename));
+                break;
+              case DIRNAME_PLACEHOLDER:
+                template_append(dirname_length ? path : ".",
+                    dirname_length ? dirname_length : 1);
+                break;
+              case STEM_PLACEHOLDER:
+                template_append(path, (size_t) (extension - path));
+                break;
+              case BASENAME_STEM_PLACEHOLDER:
+                template_append(basename, (size_t) (extension - basename));
+                break;
+              case SIZE_PLACEHOLDER:
+                template_append(size_text, strlen(size_text));
+                break;
+              default:
+                length = 1;
+                template_append(cursor, 1);
+            }
+            cursor += length;
+        }
+        template_append("", 1);
+    }
+
+    // The buffer may have moved while it was growing, so the pointers are
+    // only set once every argument has been written.
+    for (index = 0; index < template_count; index++) {
+        template_arguments[template_indexes[index]] =
+            template_buffer + template_offsets[index];
+    }
+
+    return template_arguments;
+}
+
+/**
+ * Parse a size in bytes which may have a K, M, G or T suffix for powers of
+ * 1024.
+ *
+ * @param text  Text to parse.
+ * @param size  Destination for the size.
+ *
+ * @return 0 if the text was parsed successfully and -1 otherwise.
+ */
+int parse_size(const char *text, long long *size)
+{
+    char *end;
+    const char *suffix;
+    const char *suffixes = "KMGT";
+    double value;
+
+    value = strtod(text, &end);
+    if (end == text || !(value >= 0)) {
+        return -1;
+    }
+
+    if (*end) {
+        if (!(suffix = strchr(suffixes, toupper((unsigned char) *end))) ||
+          end[1]) {
+            return -1;
+        }
+        for (; suffix >= suffixes; suffix--) {
+            value *= 1024;
+        }
+    }
+
+    if (value > 9e18) {
+        return -1;
+    }
+
+    *size = (long long) value;
+    return 0;
+}
+
+/**
+ * Parse a resource limit given with "--rlimit" and add it to the limits
+ * applied to every child.
+ *
+ * @param text  Limit in the form NAME=VALUE where VALUE is a number that may
+ *              have a K, M, G or T suffix or "unlimited".
+ *
+ * @return 0 if the limit was parsed successfully and -1 otherwise.
+ */
+int parse_rlimit(const char *text)
+{
+    size_t index;
+    size_t length;
+    long long value;
+
+    length = strcspn(text, "=");
+    for (index = 0; index < RESOURCE_COUNT; index++) {
+        if (strlen(resources[index].name) == length &&
+          !strncmp(text, resources[index].name, length)) {
+            break;
+        }
+    }
+
+    if (index == RESOURCE_COUNT || text[length] != '=') {
+        return -1;
+    } else if (!strcmp(text + length + 1, "unlimited")) {
+        child_limits[index].rlim_cur = RLIM_INFINITY;
+    } else if (parse_size(text + length + 1, &value) == -1) {
+        return -1;
+    } else {
+        child_limits[index].rlim_cur = (rlim_t) value;
+    }
+
+    child_limits[index].rlim_max = child_limits[index].rlim_cur;
+    child_limit_set[index] = 1;
+    return 0;
+}
+
+/**
+ * Parse an IO scheduling class given with "--ioprio".
+ *
+ * @param text  "idle" or "best-effort" optionally followed by a colon and a
+ *              priority level from 0, the highest, to 7.
+ *
+ * @return 0 if the class was parsed successfully and -1 otherwise.
+ */
+int parse_ioprio(const char *text)
+{
+    char *end;
+    long level;
+
+    if (!strcmp(text, "idle")) {
+        child_ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+        return 0;
+    } else if (strncmp(text, "best-effort", 11)) {
+        return -1;
+    }
+
+    level = 4;
+    if (text[11] == ':') {
+        level = strtol(text + 12, &end, 10);
+        if (end == text + 12 || *end != '\0' || level < 0 || level > 7) {
+            return -1;
+        }
+    } else if (text[11] != '\0') {
+        return -1;
+    }
+
+    child_ioprio = IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | (int) level;
+    return 0;
+}
+
+/**
+ * Parse the shard given with "--shard".
+ *
+ * @param text  Shard number K and number of shards N in the form "K/N" where
+ *              K is between 1 and N.
+ *
+ * @return 0 if the shard was parsed successfully and -1 otherwise.
+ */
+int parse_shard(const char *text)
+{
+    char *end;
+    char *slash;
+
+    shard_index = strtoull(text, &slash, 10);
+    if (slash == text || *slash != '/' || !isdigit((unsigned char) *text)) {
+        return -1;
+    }
+    shard_count = strtoull(slash + 1, &end, 10);
+    if (end == slash + 1 || *end != '\0' ||
+      !isdigit((unsigned char) slash[1]) || shard_index < 1 ||
+      shard_index > shard_count) {
+        return -1;
+    }
+
+    shard_index--;
+    return 0;
+}
+
+/**
+ * Check whether a path belongs to the shard selected with "--shard". The
+ * shard only depends on the path, so instances given the same input split it
+ * without overlap and the split is the same on every run and platform. Paths
+ * that differ in their last few characters have similar FNV-1a hashes, so the
+ * hash goes through the MurmurHash3 finalizer before it picks the shard.
+ *
+ * @param path  Path of the file.
+ *
+ * @return Non-zero if the path is in the shard.
+ */
+int in_shard(const char *path)
+{
+    unsigned long long hash;
+
+    hash = hash_path(path);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash % shard_count == shard_index;
+}
+
+/**
+ * Split the arguments after the options into queries separated by "--next"
+ * and the COMMANDs of the predicate chain of each query. COMMANDs are
+ * separated by "--and", which binds tighter, and "--or", and a "!" after a
+ * separator negates the COMMAND that follows it. The separators are replaced
+ * with null pointers so that each COMMAND is a null-terminated argument list
+ * of its own, and a separator preceded by a backslash is passed on without
+ * the backslash.
+ *
+ * @param command  Null-terminated arguments after the options.
+ * @param chain    Indicates whether separators are recognized. Otherwise the
+ *                 arguments are a single COMMAND.
+ *
+ * @return 0 on success and -1 on failure, in which case an error message has
+ * been written to stderr.
+ */
+int parse_predicates(char **command, int chain)
+{
+    size_t index;
+    int is_next;
+    int is_or;
+    int negated;
+    size_t start;
+
+    is_next = 1;
+    is_or = 1;
+    negated = 0;
+    start = 0;
+    for (index = 0; ; index++) {
+        if (!chain && command[index]) {
+            continue;
+        } else if (command[index] && command[index][0] == '\\' &&
+          (!strcmp(command[index] + 1, "--and") ||
+          !strcmp(command[index] + 1, "--or") ||
+          !strcmp(command[index] + 1, "--next"))) {
+            command[index]++;
+            if (template_arguments) {
+                template_arguments[index] = command[index];
+            }
+            continue;
+        } else if (command[index] && strcmp(command[index], "--and") &&
+          strcmp(command[index], "--or") && strcmp(command[index], "--next")) {
+            continue;
+        } else if (index == start) {
+            fputs("--and, --or and --next must be surrounded by COMMANDs.\n",
+                stderr);
+            return -1;
+        } else if (predicate_count == MAXIMUM_PREDICATES) {
+            fputs("Too many COMMANDs.\n", stderr);
+            return -1;
+        }
+
+        if (is_next) {
+            queries[query_count].first = group_count;
+            query_count++;
+        }
+        if (is_or) {
+            predicate_groups[group_count].first = predicate_count;
+            group_count++;
+            queries[query_count - 1].count++;
+        }
+        predicate_groups[group_count - 1].count++;
+        predicates[predicate_count].offset = start;
+        predicates[predicate_count].negated = negated;
+        predicate_count++;
+
+        if (!command[index]) {
+            return 0;
+        }
+
+        // Arguments with placeholders for "-t" have already been copied.
+        is_next = !strcmp(command[index], "--next");
+        is_or = is_next || !strcmp(command[index], "--or");
+        command[index] = NULL;
+        if (template_arguments) {
+            template_arguments[index] = NULL;
+        }
+        start = index + 1;
+        negated = command[start] && !strcmp(command[start], "!");
+        if (negated) {
+            start++;
+            index++;
+        }
+    }
+}
+
+/**
+ * Choose the COMMAND of a predicate chain to run next on a file. When no
+ * group of COMMANDs joined by "--and" is being evaluated, the group of the
+ * query with the lowest expected cost per success that has not failed yet is
+ * picked. Within a group, the COMMAND with the lowest expected cost per
+ * failure that has not succeeded yet is picked, since the first failure
+ * decides the group. Costs and outcomes are measured as files are processed,
+ * and COMMANDs that have not run yet are tried first in the order they were
+ * given.
+ *
+ * @param slot  Slot the file is processed in.
+ *
+ * @return Index of the COMMAND or -1 if every COMMAND of the group has
+ * succeeded or every group of the query has failed.
+ */
+int pick_predicate(slot_st *slot)
+{
+    int best;
+    double best_rank;
+    const predicate_group_st *group;
+    int index;
+    const predicate_st *predicate;
+    double rank;
+
+    best = -1;
+    best_rank = 0;
+    if (slot->group == -1) {
+        for (index = (int) queries[slot->query].first; index < (int)
+          (queries[slot->query].first + queries[slot->query].count); index++) {
+            group = &predicate_groups[index];
+            if (slot->groups_done & 1ULL << index) {
+                continue;
+            }
+            rank = group->runs ? group->cost / (double) group->runs *
+                (group->runs + 2) / (group->passes + 1) : 0;
+            if (best == -1 || rank < best_rank) {
+                best = index;
+                best_rank = rank;
+            }
+        }
+        if (best == -1) {
+            return -1;
+        }
+        slot->group = best;
+        slot->group_cost = 0;
+        slot->predicates_done = 0;
+        best = -1;
+    }
+
+    group = &predicate_groups[slot->group];
+    for (index = (int) group->first; index < (int) (group->first +
+      group->count); index++) {
+        predicate = &predicates[index];
+        if (slot->predicates_done & 1ULL << index) {
+            continue;
+        }
+        rank = predicate->runs ? predicate->cost / (double) predicate->runs *
+            (predicate->runs + 2) / (predicate->runs - predicate->passes + 1) :
+            0;
+        if (best == -1 || rank < best_rank) {
+            best = index;
+            best_rank = rank;
+        }
+    }
+
+    slot->predicate = best;
+    return best;
+}
+
+/**
+ * Record the outcome of a COMMAND of a predicate chain and choose the next
+ * one to run on the file, skipping COMMANDs that cannot change the outcome of
+ * the query. Once the outcome of a query is known, the next query starts.
+ *
+ * @param slot      Slot the file is processed in.
+ * @param success   Indicates whether the COMMAND exited with a status of 0.
+ * @param duration  Number of microseconds the COMMAND ran for.
+ *
+ * @return Index of the next COMMAND or -1 if the outcome of every query is
+ * known, in which case it has been stored in "verdicts" of the slot.
+ */
+int next_predicate(slot_st *slot, int success, long long duration)
+{
+    predicate_group_st *group;
+    int next;
+    int passed;
+    predicate_st *predicate;
+
+    predicate = &predicates[slot->predicate];
+    group = &predicate_groups[slot->group];
+    passed = success != predicate->negated;
+    predicate->runs++;
+    predicate->passes += (unsigned long long) passed;
+    predicate->cost += duration;
+    slot->group_cost += duration;
+    slot->predicates_done |= 1ULL << slot->predicate;
+
+    if (passed && (next = pick_predicate(slot)) != -1) {
+        return next;
+    }
+
+    group->runs++;
+    group->passes += (unsigned long long) passed;
+    group->cost += slot->group_cost;
+    slot->groups_done |= 1ULL << slot->group;
+    slot->group = -1;
+    if (!passed && (next = pick_predicate(slot)) != -1) {
+        return next;
+    }
+
+    slot->verdicts |= (unsigned long long) passed << slot->query;
+    if (++slot->query == (int) query_count) {
+        return -1;
+    }
+    slot->groups_done = 0;
+    return pick_predicate(slot);
+}
+
+/**
+ * Start evaluating the predicate chain for a file.
+ *
+ * @param slot  Slot the file is processed in.
+ *
+ * @return Index of the first COMMAND to run.
+ */
+int first_predicate(slot_st *slot)
+{
+    slot->query = 0;
+    slot->groups_done = 0;
+    slot->group = -1;
+    slot->verdicts = 0;
+    return pick_predicate(slot);
+}
+
+/**
+ * Create a child that runs a COMMAND with a file as its stdin. The program
+ * exits with a status of 1 if the child cannot be created.
+ *
+ * @param arguments    Null-terminated argument list of the COMMAND.
+ * @param input_fd     Descriptor used as stdin or -1 to use /dev/null.
+ * @param dev_null_fd  Descriptor for /dev/null used as stdout.
+ * @param errout_fd    Descriptor used as stderr.
+ * @param slot         Number of the slot the child runs in.
+ *
+ * @return PID of the child.
+ */
+pid_t spawn_child(char **arguments, int input_fd, int dev_null_fd,
+  int errout_fd, int slot)
+{
+    pid_t pid;
+
+    switch ((pid = fork())) {
+      case -1:
+        perror("fork");
+        stats.spawn_failures++;
+        exit(1);
+
+      case 0:
+        // Replace the inherited stdin with the descriptor for the queried
+        // file, or /dev/null when files are not opened, then exec the
+        // command. The child uses _exit(2) on failure so that the handlers
+        // registered with atexit(3) and any buffered output of the parent
+        // are not run twice.
+        if ((dup2(input_fd == -1 ? dev_null_fd : input_fd,
+              STDIN_FILENO) == -1) ||
+            (dup2(dev_null_fd, STDOUT_FILENO) == -1) ||
+            (dup2(errout_fd, STDERR_FILENO) == -1)) {
+
+            perror("dup2");
+            kill(getppid(), SIGUSR1);
+            _exit(1);
+        } else if (pinned_cpu_count && pin_cpu(slot) == -1) {
+            perror("sched_setaffinity");
+            kill(getppid(), SIGUSR1);
+            _exit(1);
+        } else if (restrict_child() == -1) {
+            kill(getppid(), SIGUSR1);
+            _exit(1);
+        }
+        sigprocmask(SIG_SETMASK, &original_mask, NULL);
+        execvp(arguments[0], arguments);
+        perror(arguments[0]);
+        kill(getppid(), SIGUSR1);
+        _exit(1);
+    }
+
+    return pid;
+}
+
+/**
+ * Apply the resource limits, niceness and IO scheduling class requested for
+ * children to the calling process. This is run by children before exec.
+ *
+ * @return 0 on success and -1 on failure, in which case an error message has
+ * been written to stderr.
+ */
+int restrict_child(void)
+{
+    size_t index;
+
+    for (index = 0; index < RESOURCE_COUNT; index++) {
+        if (child_limit_set[index] &&
+          setrlimit(resources[index].resource, &child_limits[index]) == -1) {
+            perror("setrlimit");
+            return -1;
+        }
+    }
+
+    // nice(3) can legitimately return -1, so errno is the only way to tell
+    // whether it failed.
+    errno = 0;
+    if (child_nice && nice(child_nice) == -1 && errno) {
+        perror("nice");
+        return -1;
+    }
+
+#ifdef SYS_ioprio_set
+    if (child_ioprio != -1 &&
+      syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, child_ioprio) == -1) {
+        perror("ioprio_set");
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * Check whether a file passes the filters evaluated before spawning a child.
+ *
+ * @param status  Status of the file.
+ *
+ * @return Non-zero if the COMMAND should be run for the file.
+ */
+int passes_metadata_filters(const struct stat *status)
+{
+    char type;
+    mode_t permissions;
+
+    if (size_minimum != -1 && status->st_size < size_minimum) {
+        return 0;
+    } else if (size_maximum != -1 && status->st_size > size_maximum) {
+        return 0;
+    }
+
+    if (newer_filter && (status->st_mtim.tv_sec < newer_than.tv_sec ||
+      (status->st_mtim.tv_sec == newer_than.tv_sec &&
+       status->st_mtim.tv_nsec <= newer_than.tv_nsec))) {
+        return 0;
+    }
+
+    permissions = status->st_mode & 07777 & mode_filter;
+    if ((mode_filter_kind == '=' && (status->st_mode & 07777) != mode_filter) ||
+        (mode_filter_kind == '-' && permissions != mode_filter) ||
+        (mode_filter_kind == '/' && !permissions)) {
+        return 0;
+    }
+
+    if (type_filter) {
+        if (S_ISREG(status->st_mode)) {
+            type = 'f';
+        } else if (S_ISFIFO(status->st_mode)) {
+            type = 'p';
+        } else if (S_ISCHR(status->st_mode)) {
+            type = 'c';
+        } else if (S_ISBLK(status->st_mode)) {
+            type = 'b';
+        } else if (S_ISSOCK(status->st_mode)) {
+            type = 's';
+        } else {
+            return 0;
+        }
+        return strchr(type_filter, type) != NULL;
+    }
+
+    return 1;
+}
+
+/**
+ * Wrapper for realloc(3) that makes the program exit with a status of 1 when
+ * memory cannot be allocated.
+ *
+ * @param pointer  Memory to resize or NULL.
+ * @param size     New size of the allocation.
+ *
+ * @return Pointer to the resized memory.
+ */
+void *xrealloc(void *pointer, size_t size)
+{
+    if (!(pointer = realloc(pointer, size))) {
+        perror("realloc");
+        exit(1);
+    }
+    return pointer;
+}
+
+/**
+ * Copy a string, making the program exit with a status of 1 when memory
+ * cannot be allocated.
+ *
+ * @param text  String to copy.
+ *
+ * @return Newly allocated copy of the string.
+ */
+char *xstrdup(const char *text)
+{
+    size_t size;
+
+    size = strlen(text) + 1;
+    return memcpy(xrealloc(NULL, size), text, size);
+}
+
+/**
+ * Write a string to a stream as a quoted JSON string.
+ *
+ * @param text    String to write.
+ * @param stream  Destination stream.
+ */
+void fputs_json(const char *text, FILE *stream)
+{
+    const unsigned char *cursor;
+
+    putc('"', stream);
+    for (cursor = (const unsigned char *) text; *cursor; cursor++) {
+        if (*cursor == '"' || *cursor == '\\') {
+            putc('\\', stream);
+            putc(*cursor, stream);
+        } else if (*cursor < 0x20 || *cursor == 0x7f) {
+            fprintf(stream, "\\u%04x", *cursor);
+        } else {
+            putc(*cursor, stream);
+        }
+    }
+    putc('"', stream);
+}
+
+/**
+ * Write the result for a file to stdout as a single line of JSON.
+ *
+ * @param path     Path of the file.
+ * @param verdict  One of "success", "failure", "error" or "skipped".
+ * @param match    Indicates whether the file name would have been displayed
+ *                 if JSON output were disabled.
+ * @param status   Status of the child as returned by wait4(2) or NULL if the
+ *                 COMMAND was not run.
+ * @param wall_us  Number of microseconds between the spawning of the child and
+ *                 its termination.
+ * @param usage    Resource usage of the child as returned by wait4(2) or NULL
+ *                 if the COMMAND was not run.
+ * @param error    Description of the problem for the "error" verdict or NULL.
+ */
+void write_json_result(const char *path, const char *verdict, int match,
+  const int *status, long long wall_us, const struct rusage *usage,
+  const char *error)
+{
+    long max_rss;
+
+    fputs("{\"path\":", stdout);
+    fputs_json(path, stdout);
+    printf(",\"verdict\":\"%s\",\"match\":%s", verdict,
+        match ? "true" : "false");
+
+    if (error) {
+        fputs(",\"error\":", stdout);
+        fputs_json(error, stdout);
+    }
+
+    if (status) {
+        if (WIFEXITED(*status)) {
+            printf(",\"exit_status\":%d,\"signal\":null",
+                WEXITSTATUS(*status));
+        } else {
+            printf(",\"exit_status\":null,\"signal\":%d", WTERMSIG(*status));
+        }
+    }
+
+    if (usage) {
+        // ru_maxrss is measured in bytes on macOS and kilobytes elsewhere.
+        max_rss = usage->ru_maxrss;
+#ifdef __APPLE__
+        max_rss /= 1024;
+#endif
+        printf(",\"wall_time\":%lld.%06lld,\"user_time\":%ld.%06ld,"
+            "\"system_time\":%ld.%06ld,\"max_rss_kb\":%ld,"
+            "\"minor_faults\":%ld,\"major_faults\":%ld,"
+            "\"voluntary_context_switches\":%ld,"
+            "\"involuntary_context_switches\":%ld",
+            wall_us / 1000000, wall_us % 1000000,
+            (long) usage->ru_utime.tv_sec, (long) usage->ru_utime.tv_usec,
+            (long) usage->ru_stime.tv_sec, (long) usage->ru_stime.tv_usec,
+            max_rss, usage->ru_minflt, usage->ru_majflt, usage->ru_nvcsw,
+            usage->ru_nivcsw);
+    }
+
+    fputs("}\n", stdout);
+}
+
+/**
+ * Return the value of the monotonic clock in microseconds.
+ */
+long long monotonic_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+/**
+ * Return the start time for a new span or 0 when tracing is disabled so the
+ * clock is not read unnecessarily.
+ */
+long long trace_clock(void)
+{
+    return trace_file ? monotonic_us() : 0;
+}
+
+/**
+ * Save a copy of a path for use by spans.
+ *
+ * @param path  Path of the file being processed.
+ *
+ * @return Offset of the copy in "trace_paths" or NO_TRACE_PATH when tracing is
+ * disabled.
+ */
+size_t trace_path(const char *path)
+{
+    size_t offset;
+    size_t size;
+
+    if (!trace_file) {
+        return NO_TRACE_PATH;
+    }
+
+    size = strlen(path) + 1;
+    while (trace_paths_length + size > trace_paths_capacity) {
+        trace_paths_capacity = trace_paths_capacity ?
+            trace_paths_capacity * 2 : 65536;
+        trace_paths = xrealloc(trace_paths, trace_paths_capacity);
+    }
+
+    offset = trace_paths_length;
+    memcpy(trace_paths + offset, path, size);
+    trace_paths_length += size;
+    return offset;
+}
+
+/**
+ * Record a span that ends now. Nothing is done when tracing is disabled.
+ *
+ * @param name         Name of the span.
+ * @param start        Start time of the span as returned by "trace_clock".
+ * @param slot         Worker slot the span belongs to or -1 for spans of the
+ *                     parent process.
+ * @param path_offset  Value returned by "trace_path" for the file being
+ *                     processed or NO_TRACE_PATH.
+ *
+ * @return End time of the span which can be used as the start of the next.
+ */
+long long trace_span(const char *name, long long start, int slot,
+  size_t path_offset)
+{
+    long long end;
+    trace_event_st *event;
+
+    if (!trace_file) {
+        return 0;
+    }
+
+    if (trace_event_count == trace_event_capacity) {
+        trace_event_capacity = trace_event_capacity ?
+            trace_event_capacity * 2 : 4096;
+        trace_events = xrealloc(trace_events,
+            trace_event_capacity * sizeof(*trace_events));
+    }
+
+    end = monotonic_us();
+    event = &trace_events[trace_event_count++];
+    event->name = name;
+    event->start = start;
+    event->duration = end - start;
+    event->slot = slot;
+    event->path_offset = path_offset;
+
+    if (slot > trace_max_slot) {
+        trace_max_slot = slot;
+    }
+
+    return end;
+}
+
+/**
+ * Write the recorded spans to the trace file. This is registered with
+ * atexit(3) so the trace is also written when a fatal error occurs.
+ */
+void write_trace(void)
+{
+    long long epoch;
+    trace_event_st *event;
+    size_t index;
+    int pid;
+    int slot;
+
+    if (!trace_file) {
+        return;
+    }
+
+    epoch = trace_event_count ? trace_events[0].start : 0;
+    pid = (int) getpid();
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", trace_file);
+    fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+        "\"tid\":0,\"args\":{\"name\":\"parent\"}}", pid);
+    for (slot = 0; slot <= trace_max_slot; slot++) {
+        fprintf(trace_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"slot %d\"}}",
+            pid, slot + 1, slot);
+    }
+
+    for (index = 0; index < trace_event_count; index++) {
+        event = &trace_events[index];
+        fprintf(trace_file, ",\n{\"name\":\"%s\",\"cat\":\"query\","
+            "\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,"
+            "\"args\":{",
+            event->name, event->start - epoch, event->duration, pid,
+            event->slot + 1);
+        if (event->slot >= 0) {
+            fprintf(trace_file, "\"slot\":%d", event->slot);
+        }
+        if (event->path_offset != NO_TRACE_PATH) {
+            fputs(event->slot >= 0 ? ",\"path\":" : "\"path\":", trace_file);
+            fputs_json(trace_paths + event->path_offset, trace_file);
+        }
+        fputs("}}", trace_file);
+    }
+    fputs("\n]}\n", trace_file);
+
+    if (fclose(trace_file) == EOF) {
+        perror("trace");
+    }
+    trace_file = NULL;
+    free(trace_events);
+    free(trace_paths);
+}
+
+/**
+ * Handler for SIGCHLD. It does nothing, but a handler must be installed for
+ * the signal to interrupt pselect(2).
+ */
+void sigchld_handler(int signal)
+{
+}
+
+/**
+ * Handler for SIGUSR2 which requests a progress report.
+ */
+void sigusr2_handler(int signal)
+{
+    progress_requested = 1;
+}
+
+/**
+ * Write a summary of the work done so far and the files currently being
+ * processed to stderr.
+ */
+void write_progress(void)
+{
+    long long eta;
+    long long elapsed;
+    long long now;
+    double rate;
+    slot_st *slot;
+
+    now = monotonic_us();
+    elapsed = now - stats.start;
+    rate = now > progress_previous_time ?
+        (stats.files - progress_previous_files) * 1e6 /
+        (now - progress_previous_time) : 0;
+
+    fprintf(stderr, "query: %llu files, %llu matches, %llu errors, %llu "
+        "skipped in %.1fs; %.1f files/s", stats.files, stats.matches,
+        stats.errors, stats.skipped, elapsed / 1e6, rate);
+
+    if (stats.input_size > 0) {
+        fprintf(stderr, "; %.1f%% of input",
+            stats.input_bytes * 100.0 / stats.input_size);
+        if (stats.input_bytes > 0) {
+            eta = (long long) ((double) elapsed *
+                (stats.input_size - stats.input_bytes) / stats.input_bytes);
+            eta /= 1000000;
+            fprintf(stderr, ", ETA %lld:%02lld:%02lld", eta / 3600,
+                eta / 60 % 60, eta % 60);
+        }
+    }
+    if (maximum_jobs > 1) {
+        fprintf(stderr, "; %d of %d slots busy", running_children, jobs);
+    }
+    fputc('\n', stderr);
+
+    for (slot = slots; slot < slots + maximum_jobs; slot++) {
+        if (slot->pid) {
+            fprintf(stderr, "query:   %s (%.1fs)\n", slot->path,
+                (now - slot->start) / 1e6);
+        }
+    }
+
+    progress_previous_time = now;
+    progress_previous_files = stats.files;
+}
+
+/**
+ * Write a progress report if one was requested with SIGUSR2 or the next
+ * periodic report is due.
+ */
+void check_progress(void)
+{
+    long long now;
+
+    if (progress_requested) {
+        progress_requested = 0;
+        write_progress();
+    }
+
+    if (progress_interval && (now = monotonic_us()) >= progress_due) {
+        write_progress();
+        while (progress_due <= now) {
+            progress_due += progress_interval;
+        }
+    }
+}
+
+/**
+ * Record the run time of a COMMAND in the histogram exported by
+ * "--metrics-file".
+ *
+ * @param duration  Number of microseconds the child ran for.
+ */
+void observe_child(long long duration)
+{
+    size_t bucket;
+
+    for (bucket = 0; bucket < CHILD_DURATION_BUCKETS; bucket++) {
+        if (duration <= child_duration_buckets[bucket] * 1e6) {
+            break;
+        }
+    }
+
+    child_duration_counts[bucket]++;
+    child_duration_sum += duration;
+}
+
+/**
+ * Write a Prometheus metric header.
+ *
+ * @param stream  Destination stream.
+ * @param name    Name of the metric.
+ * @param type    Type of the metric.
+ * @param help    Description of the metric.
+ */
+void write_metric_header(FILE *stream, const char *name,
+  const char *type, const char *help)
+{
+    fprintf(stream, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Atomically replace the metrics file with the current values of the metrics.
+ * This is registered with atexit(3) so the final values are always exported.
+ */
+void write_metrics(void)
+{
+    size_t bucket;
+    unsigned long long cumulative;
+    FILE *stream;
+    struct rusage usage;
+
+    if (!metrics_path) {
+        return;
+    }
+
+    if (!(stream = fopen(metrics_temporary_path, "w"))) {
+        perror(metrics_temporary_path);
+        return;
+    }
+
+    write_metric_header(stream, "query_files_total", "counter",
+        "Files whose processing has finished.");
+    fprintf(stream, "query_files_total %llu\n", stats.files);
+    write_metric_header(stream, "query_matches_total", "counter",
+        "Files whose names were displayed.");
+    fprintf(stream, "query_matches_total %llu\n", stats.matches);
+    write_metric_header(stream, "query_errors_total", "counter",
+        "Files that could not be queried because of an error.");
+    fprintf(stream, "query_errors_total %llu\n", stats.errors);
+    write_metric_header(stream, "query_skipped_total", "counter",
+        "Files rejected by filters without running the COMMAND.");
+    fprintf(stream, "query_skipped_total %llu\n", stats.skipped);
+    write_metric_header(stream, "query_spawn_failures_total", "counter",
+        "Children that could not be created.");
+    fprintf(stream, "query_spawn_failures_total %llu\n",
+        stats.spawn_failures);
+    write_metric_header(stream, "query_input_bytes_total", "counter",
+        "Bytes of input consumed.");
+    fprintf(stream, "query_input_bytes_total %lld\n", stats.input_bytes);
+    write_metric_header(stream, "query_children_in_flight", "gauge",
+        "Children currently running.");
+    fprintf(stream, "query_children_in_flight %d\n", running_children);
+    write_metric_header(stream, "query_children_limit", "gauge",
+        "Maximum number of children allowed to run at once.");
+    fprintf(stream, "query_children_limit %d\n", jobs);
+
+    write_metric_header(stream, "query_child_duration_seconds", "histogram",
+        "Time between spawning a child and reaping it.");
+    cumulative = 0;
+    for (bucket = 0; bucket < CHILD_DURATION_BUCKETS; bucket++) {
+        cumulative += child_duration_counts[bucket];
+        fprintf(stream, "query_child_duration_seconds_bucket{le=\"%g\"} %llu\n",
+            child_duration_buckets[bucket], cumulative);
+    }
+    cumulative += child_duration_counts[CHILD_DURATION_BUCKETS];
+    fprintf(stream, "query_child_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+        "query_child_duration_seconds_sum %lld.%06lld\n"
+        "query_child_duration_seconds_count %llu\n", cumulative,
+        child_duration_sum / 1000000, child_duration_sum % 1000000,
+        cumulative);
+
+    // The CPU time of the parent alone, excluding its children, shows how much
+    // overhead query itself adds per file.
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        write_metric_header(stream, "process_cpu_seconds_total", "counter",
+            "User and system CPU time spent by query itself.");
+        fprintf(stream, "process_cpu_seconds_total %.6f\n",
+            usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+    }
+
+    if (fclose(stream) == EOF) {
+        perror(metrics_temporary_path);
+    } else if (rename(metrics_temporary_path, metrics_path) == -1) {
+        perror(metrics_path);
+    }
+}
+
+/**
+ * Rewrite the metrics file if it is due to be updated.
+ */
+void check_metrics(void)
+{
+    long long now;
+
+    if (metrics_path && (now = monotonic_us()) >= metrics_due) {
+        write_metrics();
+        metrics_due = now + METRICS_INTERVAL;
+    }
+}
+
+/**
+ * Compute the 64-bit FNV-1a hash of a path. The journal stores hashes instead
+ * of paths so its records stay small and fixed in size.
+ *
+ * @param path  Path to hash.
+ *
+ * @return Hash of the path.
+ */
+unsigned long long hash_path(const char *path)
+{
+    const unsigned char *cursor;
+    unsigned long long hash;
+
+    hash = 0xcbf29ce484222325ULL;
+    for (cursor = (const unsigned char *) path; *cursor; cursor++) {
+        hash ^= *cursor;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Comparison function for qsort(3) and bsearch(3) that sorts journal entries
+ * by sequence number and path hash.
+ */
+int compare_journal_entries(const void *a, const void *b)
+{
+    const journal_entry_st *left = a;
+    const journal_entry_st *right = b;
+
+    if (left->sequence != right->sequence) {
+        return left->sequence < right->sequence ? -1 : 1;
+    } else if (left->hash != right->hash) {
+        return left->hash < right->hash ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Read the records of a journal written by an earlier run for "--resume". A
+ * record cut short by a crash is removed from the end of the file so that
+ * new records can be appended after it.
+ *
+ * @param path  Path of the journal. A journal that does not exist is empty.
+ *
+ * @return 0 on success and -1 on failure with errno set.
+ */
+int load_journal(const char *path)
+{
+    size_t capacity;
+    journal_entry_st entry;
+    int error_number;
+    ssize_t length;
+    char *record;
+    size_t record_capacity;
+    FILE *stream;
+    off_t valid_length;
+
+    if (!(stream = fopen(path, "r"))) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    capacity = 0;
+    record = NULL;
+    record_capacity = 0;
+    valid_length = 0;
+    while ((length = getline(&record, &record_capacity, stream)) != -1 &&
+      record[length - 1] == '\n') {
+        valid_length += (off_t) length;
+        if (sscanf(record, "%llu %llx %c", &entry.sequence, &entry.hash,
+          &entry.verdict) != 3 ||
+          (entry.verdict != 's' && entry.verdict != 'f')) {
+            continue;
+        }
+
+        if (journal_entry_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            journal_entries = xrealloc(journal_entries,
+                capacity * sizeof(*journal_entries));
+        }
+        journal_entries[journal_entry_count++] = entry;
+    }
+
+    error_number = ferror(stream) ? errno : 0;
+    free(record);
+    fclose(stream);
+    if (error_number || (length != -1 && truncate(path, valid_length) == -1)) {
+        errno = error_number ? error_number : errno;
+        return -1;
+    }
+
+    qsort(journal_entries, journal_entry_count, sizeof(*journal_entries),
+        compare_journal_entries);
+    return 0;
+}
+
+/**
+ * Look up the result an earlier run recorded in the journal for a path.
+ *
+ * @param sequence  Position of the path in the input counting from 1.
+ * @param path      Path of the file.
+ *
+ * @return 's' if the COMMAND succeeded, 'f' if it failed and 0 if the journal
+ * has no result for the path at this position.
+ */
+char find_journal_entry(unsigned long long sequence, const char *path)
+{
+    journal_entry_st key;
+    const journal_entry_st *entry;
+
+    if (!journal_entry_count) {
+        return 0;
+    }
+
+    key.sequence = sequence;
+    key.hash = hash_path(path);
+    entry = bsearch(&key, journal_entries, journal_entry_count,
+        sizeof(*journal_entries), compare_journal_entries);
+    return entry ? entry->verdict : 0;
+}
+
+/**
+ * Write the buffered journal records to the journal and flush them to stable
+ * storage. This is registered with atexit(3) so no finished file is lost on
+ * a clean exit.
+ */
+void write_journal(void)
+{
+    size_t offset;
+    ssize_t written;
+
+    if (journal_fd == -1 || !journal_used) {
+        return;
+    }
+
+    for (offset = 0; offset < journal_used; offset += (size_t) written) {
+        if ((written = write(journal_fd, journal_buffer + offset,
+          journal_used - offset)) == -1) {
+            perror(journal_path);
+            close(journal_fd);
+            journal_fd = -1;
+            return;
+        }
+    }
+
+    if (fsync(journal_fd) == -1) {
+        perror(journal_path);
+    }
+    journal_used = 0;
+}
+
+/**
+ * Write the buffered journal records if they are due to be written.
+ */
+void check_journal(void)
+{
+    long long now;
+
+    if (journal_used && (now = monotonic_us()) >= journal_due) {
+        write_journal();
+        journal_due = now + JOURNAL_INTERVAL;
+    }
+}
+
+/**
+ * Add the result of a file to the journal. Records are buffered and written
+ * together so that the journal costs one write(2) and one fsync(2) per batch
+ * instead of per file.
+ *
+ * @param sequence  Position of the path in the input counting from 1.
+ * @param path      Path of the file.
+ * @param success   Indicates whether the COMMAND succeeded.
+ */
+void journal_result(unsigned long long sequence, const char *path,
+  int success)
+{
+    if (journal_fd == -1) {
+        return;
+    }
+
+    if (journal_used + JOURNAL_RECORD_MAX > sizeof(journal_buffer)) {
+        write_journal();
+        journal_due = monotonic_us() + JOURNAL_INTERVAL;
+    }
+    journal_used += (size_t) sprintf(journal_buffer + journal_used,
+        "%llu %016llx %c\n", sequence, hash_path(path), success ? 's' : 'f');
+    check_journal();
+}
+
+/**
+ * Read a CPU bandwidth quota and period.
+ *
+ * @param quota_path   File containing the quota in microseconds, followed by
+ *                     the period when "period_path" is NULL.
+ * @param period_path  File containing the period in microseconds or NULL.
+ *
+ * @return Number of CPUs the quota allows rounded up or 0 when there is no
+ * quota or it cannot be read.
+ */
+int read_cpu_quota(const char *quota_path, const char *period_path)
+{
+    int count;
+    long long period;
+    long long quota;
+    FILE *stream;
+
+    if (!(stream = fopen(quota_path, "r"))) {
+        return 0;
+    }
+    count = fscanf(stream, "%lld %lld", &quota, &period);
+    fclose(stream);
+
+    if (period_path && count >= 1) {
+        if (!(stream = fopen(period_path, "r"))) {
+            return 0;
+        }
+        count = fscanf(stream, "%lld", &period) + 1;
+        fclose(stream);
+    }
+
+    if (count != 2 || quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return (int) ((quota + period - 1) / period);
+}
+
+/**
+ * Return the CPU bandwidth limit imposed on query by the cgroup CPU controller
+ * as a number of CPUs rounded up. For cgroup v2, the cpu.max files of the
+ * cgroup of query and all of its ancestors are checked. For cgroup v1, only
+ * the root of the controller's mount is checked since that is where the
+ * cgroup of a container is visible from inside of it.
+ *
+ * @return Number of CPUs or 0 when there is no limit or it is unknown.
+ */
+int cgroup_cpu_limit(void)
+{
+    static const char *v1_directories[] = {
+        "/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu",
+    };
+    char *cgroup;
+    int cpus;
+    char entry[PATH_MAX];
+    size_t index;
+    int limit;
+    char path[PATH_MAX + 64];
+    char period_path[PATH_MAX];
+    char *slash;
+    FILE *stream;
+
+    // The cgroup v2 hierarchy is listed as "0::PATH" in /proc/self/cgroup.
+    cgroup = NULL;
+    if ((stream = fopen("/proc/self/cgroup", "r"))) {
+        while (fgets(entry, sizeof(entry), stream)) {
+            if (!strncmp(entry, "0::/", 4)) {
+                entry[strcspn(entry, "\n")] = '\0';
+                cgroup = entry + 3;
+                break;
+            }
+        }
+        fclose(stream);
+    }
+
+    limit = 0;
+    while (cgroup) {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max",
+            strcmp(cgroup, "/") ? cgroup : "");
+        if ((cpus = read_cpu_quota(path, NULL)) && (!limit || cpus < limit)) {
+            limit = cpus;
+        }
+        if (!strcmp(cgroup, "/")) {
+            break;
+        }
+        slash = strrchr(cgroup, '/');
+        slash[slash == cgroup] = '\0';
+    }
+
+    for (index = 0; index < 2; index++) {
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us",
+            v1_directories[index]);
+        snprintf(period_path, sizeof(period_path), "%s/cpu.cfs_period_us",
+            v1_directories[index]);
+        if ((cpus = read_cpu_quota(path, period_path)) &&
+          (!limit || cpus < limit)) {
+            limit = cpus;
+        }
+    }
+
+    return limit;
+}
+
+/**
+ * Return the number of CPUs query can use: the CPUs in its affinity mask, or
+ * the online CPUs where affinity masks are not available, capped by the
+ * cgroup CPU quota.
+ */
+int cpu_count(void)
+{
+    long count;
+    int limit;
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        count = CPU_COUNT(&set);
+    } else {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+#else
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    count = count > 0 ? count : 1;
+    limit = cgroup_cpu_limit();
+    return (int) (limit && limit < count ? limit : count);
+}
+
+/**
+ * Record the CPUs in the affinity mask of query so that the children of each
+ * slot can be pinned to one of them with "--pin-cpus".
+ *
+ * @return 0 on success and -1 on failure with errno set.
+ */
+int prepare_pinning(void)
+{
+#ifdef __linux__
+    int cpu;
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+        return -1;
+    }
+
+    pinned_cpus = xrealloc(NULL, CPU_COUNT(&set) * sizeof(*pinned_cpus));
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            pinned_cpus[pinned_cpu_count++] = cpu;
+        }
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Restrict the calling process to the CPU assigned to a slot. Slots beyond
+ * the number of CPUs share them in a round-robin fashion.
+ *
+ * @param slot  Index of the slot.
+ *
+ * @return 0 on success and -1 on failure with errno set.
+ */
+int pin_cpu(int slot)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(pinned_cpus[slot % pinned_cpu_count], &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Return the lowest free slot so that traces only show as many tracks as were
+ * needed. There must be a free slot.
+ */
+slot_st *free_slot(void)
+{
+    slot_st *slot;
+
+    for (slot = slots; slot->pid; slot++);
+    return slot;
+}
+
+/**
+ * Record a child that was just spawned in a free slot.
+ *
+ * @param slot   Slot returned by "free_slot".
+ * @param pid    PID of the child.
+ * @param path   Path of the file the child is processing. It is copied since
+ *               the input buffer is reused while the child runs.
+ * @param start  Time the child was spawned.
+ */
+void claim_slot(slot_st *slot, pid_t pid, const char *path, long long start)
+{
+    size_t length;
+
+    length = strlen(path) + 1;
+    if (length > slot->path_capacity) {
+        slot->path_capacity = length;
+        slot->path = xrealloc(slot->path, length);
+    }
+    memcpy(slot->path, path, length);
+    slot->pid = pid;
+    slot->stale = 0;
+    slot->start = start;
+    running_children++;
+}
+
+/**
+ * Return the fraction of time since the previous call during which some tasks
+ * were stalled waiting on the CPU, IO or memory, whichever is worst,
+ * according to the pressure stall information of Linux.
+ *
+ * @param elapsed  Number of microseconds since the previous call.
+ *
+ * @return Fraction of time or 0 when the information is unavailable.
+ */
+double sample_pressure(long long elapsed)
+{
+    size_t index;
+    double pressure;
+    FILE *stream;
+    long long total;
+
+    pressure = 0;
+    for (index = 0; index < PRESSURE_RESOURCES; index++) {
+        total = -1;
+        if ((stream = fopen(pressure_paths[index], "r"))) {
+            if (fscanf(stream, "some avg10=%*f avg60=%*f avg300=%*f "
+              "total=%lld", &total) != 1) {
+                total = -1;
+            }
+            fclose(stream);
+        }
+
+        if (total != -1 && control_stall[index] != -1 && elapsed > 0 &&
+          (total - control_stall[index]) / (double) elapsed > pressure) {
+            pressure = (total - control_stall[index]) / (double) elapsed;
+        }
+        control_stall[index] = total;
+    }
+
+    return pressure;
+}
+
+/**
+ * Return the fraction of CPU time spent doing work across the system since the
+ * previous call according to /proc/stat.
+ *
+ * @return Fraction of time or 0 when the information is unavailable.
+ */
+double sample_utilization(void)
+{
+    long long busy;
+    size_t index;
+    FILE *stream;
+    long long total;
+    double utilization;
+    long long values[8];
+
+    // The fields are user, nice, system, idle, iowait, irq, softirq and
+    // steal time. Time spent waiting on IO counts as idle.
+    memset(values, 0, sizeof(values));
+    if (!(stream = fopen("/proc/stat", "r"))) {
+        return 0;
+    } else if (fscanf(stream, "cpu %lld %lld %lld %lld %lld %lld %lld %lld",
+      &values[0], &values[1], &values[2], &values[3], &values[4], &values[5],
+      &values[6], &values[7]) < 4) {
+        fclose(stream);
+        return 0;
+    }
+    fclose(stream);
+
+    for (total = 0, index = 0; index < 8; index++) {
+        total += values[index];
+    }
+    busy = total - values[3] - values[4];
+
+    utilization = 0;
+    if (control_cpu_total != -1 && total > control_cpu_total) {
+        utilization = (double) (busy - control_cpu_busy) /
+            (total - control_cpu_total);
+    }
+    control_cpu_busy = busy;
+    control_cpu_total = total;
+    return utilization;
+}
+
+/**
+ * Change the number of children allowed to run at once for "-j auto". Like
+ * TCP congestion control, the limit doubles while each increase pays off,
+ * then grows by one at a time. An increase is undone when it does not deliver
+ * at least half of the gain in throughput that linear scaling would give, and
+ * the limit is cut by a quarter when the host is under pressure. Nothing is
+ * added while the CPUs are saturated or the input does not keep every slot
+ * busy.
+ */
+void adjust_concurrency(void)
+{
+    long long elapsed;
+    long long now;
+    double pressure;
+    double rate;
+    int step;
+    double utilization;
+
+    now = monotonic_us();
+    elapsed = now - control_previous_time;
+    rate = elapsed > 0 ?
+        (stats.files - control_previous_files) * 1e6 / elapsed : 0;
+    pressure = sample_pressure(elapsed);
+    utilization = sample_utilization();
+
+    if (pressure > PRESSURE_LIMIT) {
+        step = -((jobs + 3) / 4);
+        control_slow_start = 0;
+    } else if (control_step > 0 && rate < control_rate *
+      (1 + control_step / (2.0 * (jobs - control_step)))) {
+        step = -control_step;
+        control_slow_start = 0;
+    } else if (control_step < 0 || !control_saturated ||
+      utilization > UTILIZATION_LIMIT) {
+        // After a decrease, the limit is held for an interval so the
+        // throughput at the new limit can be measured.
+        step = 0;
+    } else {
+        step = control_slow_start ? jobs : 1;
+    }
+
+    if (jobs + step > maximum_jobs) {
+        step = maximum_jobs - jobs;
+    } else if (jobs + step < 1) {
+        step = 1 - jobs;
+    }
+
+    jobs += step;
+    control_step = step;
+    control_rate = rate;
+    control_saturated = 0;
+    control_previous_time = now;
+    control_previous_files = stats.files;
+}
+
+/**
+ * Adjust the number of children allowed to run at once if "-j auto" is used
+ * and the next adjustment is due.
+ */
+void check_concurrency(void)
+{
+    long long now;
+
+    if (auto_jobs && (now = monotonic_us()) >= control_due) {
+        adjust_concurrency();
+        control_due = now + CONTROL_INTERVAL;
+    }
+}
+
+/**
+ * Add the tokens earned since a token bucket was last updated.
+ *
+ * @param bucket  Token bucket.
+ * @param now     Current time.
+ */
+void refill_bucket(bucket_st *bucket, long long now)
+{
+    bucket->tokens += (now - bucket->updated) * bucket->rate / 1e6;
+    if (bucket->tokens > bucket->capacity) {
+        bucket->tokens = bucket->capacity;
+    }
+    bucket->updated = now;
+}
+
+/**
+ * Check whether the next file has to wait for the "--max-rate" or
+ * "--max-read-rate" limits. Buckets may go into debt, e.g. when a file is
+ * larger than the read rate allows per second, and nothing is dispatched
+ * until the debt is paid off. When a limit applies, "rate_due" is set to the
+ * time the next file can be dispatched; otherwise it is set to -1.
+ *
+ * @return Non-zero if the next file has to wait.
+ */
+int rate_limited(void)
+{
+    bucket_st *bucket;
+    long long due;
+    long long now;
+
+    rate_due = -1;
+    if (!spawn_bucket.rate && !read_bucket.rate) {
+        return 0;
+    }
+
+    now = monotonic_us();
+    for (bucket = &spawn_bucket; bucket; bucket = bucket == &spawn_bucket ?
+      &read_bucket : NULL) {
+        if (!bucket->rate) {
+            continue;
+        }
+        refill_bucket(bucket, now);
+        if (bucket->tokens < 0) {
+            due = now + (long long) (-bucket->tokens / bucket->rate * 1e6) + 1;
+            rate_due = due > rate_due ? due : rate_due;
+        }
+    }
+
+    return rate_due != -1;
+}
+
+/**
+ * Sleep until a signal handled by the parent is delivered, a descriptor
+ * becomes readable or the next periodic task is due, then run any periodic
+ * tasks that need to be run.
+ *
+ * @param fd  Descriptor to wait on or -1 to only wait for signals.
+ */
+void wait_for_signal(int fd)
+{
+    long long deadline;
+    fd_set readable;
+    long long remaining;
+    struct timespec timeout;
+
+    deadline = -1;
+    if (progress_interval) {
+        deadline = progress_due;
+    }
+    if (metrics_path && (deadline == -1 || metrics_due < deadline)) {
+        deadline = metrics_due;
+    }
+    if (auto_jobs && (deadline == -1 || control_due < deadline)) {
+        deadline = control_due;
+    }
+    if (rate_due != -1 && (deadline == -1 || rate_due < deadline)) {
+        deadline = rate_due;
+    }
+    if (journal_used && (deadline == -1 || journal_due < deadline)) {
+        deadline = journal_due;
+    }
+
+    if (deadline != -1) {
+        remaining = deadline - monotonic_us();
+        remaining = remaining > 0 ? remaining : 0;
+        timeout.tv_sec = (time_t) (remaining / 1000000);
+        timeout.tv_nsec = (long) (remaining % 1000000 * 1000);
+    }
+
+    FD_ZERO(&readable);
+    if (fd != -1) {
+        FD_SET(fd, &readable);
+    }
+    pselect(fd + 1, fd != -1 ? &readable : NULL, NULL, NULL,
+        deadline != -1 ? &timeout : NULL, &wait_mask);
+
+    check_exec_failure();
+    check_progress();
+    check_metrics();
+    check_concurrency();
+    check_journal();
+}
+
+/**
+ * Handler for SIGUSR1. The signal is sent by the child process after a fork
+ * to indicate that execvp(3) failed, which is a fatal error that is acted on
+ * by "check_exec_failure".
+ */
+void sigusr1_handler(int signal)
+{
+    exec_failed = 1;
+}
+
+/**
+ * Make the program exit with a status of 1 if a child could not run the
+ * COMMAND. A child sends SIGUSR1 before it exits, so the signal is already
+ * pending when the child is collected even if it has not been delivered.
+ */
+void check_exec_failure(void)
+{
+    sigset_t pending;
+
+    if (exec_failed || (sigpending(&pending) == 0 &&
+      sigismember(&pending, SIGUSR1))) {
+        exit(1);
+    }
+}
+
+/**
+ * Write a buffer to a socket in full, waiting for the socket to become
+ * writable when its buffer is full. SIGPIPE is suppressed so that a peer that
+ * went away is reported as an error instead of killing query.
+ *
+ * @param fd      Descriptor of the socket.
+ * @param data    Data to write.
+ * @param length  Number of bytes to write.
+ *
+ * @return 0 on success and -1 on failure with errno set.
+ */
+int send_all(int fd, const char *data, size_t length)
+{
+    ssize_t sent;
+    fd_set writable;
+
+    while (length) {
+        if ((sent = send(fd, data, length, MSG_NOSIGNAL)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            FD_ZERO(&writable);
+            FD_SET(fd, &writable);
+            select(fd + 1, NULL, &writable, NULL, NULL);
+            continue;
+        }
+        data += sent;
+        length -= (size_t) sent;
+    }
+
+    return 0;
+}
+
+/**
+ * Create a UNIX domain stream socket and either listen on it at a path or
+ * connect it to the socket at that path.
+ *
+ * @param path   Path of the socket.
+ * @param serve  Indicates whether to listen instead of connecting.
+ *
+ * @return Descriptor of the socket or -1 on failure with errno set.
+ */
+int open_socket(const char *path, int serve)
+{
+    struct sockaddr_un address;
+    int error_number;
+    int fd;
+    int result;
+#ifdef SO_NOSIGPIPE
+    int enable = 1;
+#endif
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    } else if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    if (!serve) {
+        result = connect(fd, (struct sockaddr *) &address, sizeof(address));
+    } else if ((result = bind(fd, (struct sockaddr *) &address,
+      sizeof(address))) == 0 && (result = listen(fd, SOMAXCONN)) == -1) {
+        error_number = errno;
+        unlink(path);
+        errno = error_number;
+    }
+#ifdef SO_NOSIGPIPE
+    if (result == 0) {
+        result = setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &enable,
+            sizeof(enable));
+    }
+#endif
+
+    if (result == -1) {
+        error_number = errno;
+        close(fd);
+        errno = error_number;
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Remove the socket of the coordinator. This is registered with atexit(3)
+ * once the socket has been created.
+ */
+void remove_socket(void)
+{
+    unlink(socket_path);
+}
+
+/**
+ * Take the next path to process from the batches sent by the coordinator,
+ * asking it for another batch when the current one has been used up. The
+ * coordinator sends each path as a decimal sequence number, a space and the
+ * path terminated by a null byte, and ends every batch with an empty record.
+ * An empty batch means there is nothing left to do.
+ *
+ * @param path      Set to the path, which remains valid until the next call.
+ * @param sequence  Set to the position of the path in the input of the
+ *                  coordinator.
+ *
+ * @return 1 when a path was taken, 0 when there are no paths left and -1 when
+ * the next batch has not arrived yet, in which case the caller should wait
+ * for "worker_fd" to become readable.
+ */
+int pull_path(char **path, unsigned long long *sequence)
+{
+    char *end;
+    ssize_t length;
+    char *record;
+    char *record_end;
+
+    while (1) {
+        record = worker_buffer + worker_buffer_offset;
+        if ((record_end = memchr(record, '\0',
+          worker_buffer_used - worker_buffer_offset))) {
+            worker_buffer_offset = (size_t) (record_end - worker_buffer) + 1;
+            if (record == record_end) {
+                if (!worker_batch_paths) {
+                    return 0;
+                }
+                worker_batch_paths = 0;
+                worker_requested = 0;
+                continue;
+            }
+
+            *sequence = strtoull(record, &end, 10);
+            if (end == record || *end != ' ') {
+                fprintf(stderr, "%s: invalid record from coordinator\n",
+                    socket_path);
+                exit(1);
+            }
+            *path = end + 1;
+            worker_batch_paths++;
+            return 1;
+        }
+
+        // The coordinator closes the socket once every result is in, so it
+        // may be gone by the time the next batch is asked for.
+        if (!worker_requested) {
+            if (send_all(worker_fd, "", 1) == -1) {
+                if (errno == EPIPE || errno == ECONNRESET) {
+                    return 0;
+                }
+                perror(socket_path);
+                exit(1);
+            }
+            worker_requested = 1;
+        }
+
+        // Records that have been taken are dropped before reading more so the
+        // buffer only has to hold one batch.
+        memmove(worker_buffer, worker_buffer + worker_buffer_offset,
+            worker_buffer_used - worker_buffer_offset);
+        worker_buffer_used -= worker_buffer_offset;
+        worker_buffer_offset = 0;
+        if (worker_buffer_capacity - worker_buffer_used < 65536) {
+            worker_buffer_capacity = worker_buffer_capacity * 2 + 65536;
+            worker_buffer = xrealloc(worker_buffer, worker_buffer_capacity);
+        }
+
+        length = read(worker_fd, worker_buffer + worker_buffer_used,
+            worker_buffer_capacity - worker_buffer_used);
+        if (length > 0) {
+            worker_buffer_used += (size_t) length;
+        } else if (length == 0 || errno == ECONNRESET) {
+            return 0;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        } else {
+            perror(socket_path);
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Send the result for a file to the coordinator as a decimal sequence
+ * number, the verdict and, for errors, a description of the problem,
+ * separated by spaces and terminated by a null byte.
+ *
+ * @param sequence  Position of the path in the input of the coordinator.
+ * @param verdict   One of "success", "failure", "error" or "skipped".
+ * @param error     Description of the problem for the "error" verdict or
+ *                  NULL.
+ */
+void send_result(unsigned long long sequence, const char *verdict,
+  const char *error)
+{
+    char record[512];
+    int length;
+
+    length = snprintf(record, sizeof(record), "%llu %s%s%s", sequence,
+        verdict, error ? " " : "", error ? error : "");
+    length = length < (int) sizeof(record) ? length :
+        (int) sizeof(record) - 1;
+    if (send_all(worker_fd, record, (size_t) length + 1) == -1) {
+        perror(socket_path);
+        exit(1);
+    }
+}
+
+/**
+ * Find a path that has been read by the coordinator.
+ *
+ * @param sequence  Position of the path in the input.
+ *
+ * @return The path or NULL if it has already been reported or was never read.
+ */
+work_item_st *find_work_item(unsigned long long sequence)
+{
+    size_t high;
+    size_t low;
+    size_t middle;
+
+    for (low = work_head, high = work_count; low < high; ) {
+        middle = low + (high - low) / 2;
+        if (work[middle].sequence < sequence) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low < work_count && work[low].sequence == sequence ? &work[low] :
+        NULL;
+}
+
+/**
+ * Remember a path read by the coordinator until its result is reported.
+ *
+ * @param sequence            Position of the path in the input.
+ * @param path                Path of the file.
+ * @param display_on_success  Indicates whether the names of files the
+ *                            COMMAND succeeded or failed on are displayed.
+ *
+ * @return The path to hand out to a worker, or NULL if the path belongs to
+ * another shard or its result was taken from the journal with "--resume".
+ */
+work_item_st *add_work_item(unsigned long long sequence, const char *path,
+  int display_on_success)
+{
+    work_item_st *item;
+    char verdict;
+
+    if (shard_count && !in_shard(path)) {
+        return NULL;
+    }
+
+    // Reported paths are dropped from the front before the array grows.
+    if (work_count == work_capacity) {
+        if (work_head) {
+            memmove(work, work + work_head,
+                (work_count - work_head) * sizeof(*work));
+            work_count -= work_head;
+            work_head = 0;
+        }
+        if (work_count * 2 >= work_capacity) {
+            work_capacity = work_capacity * 2 + 256;
+            work = xrealloc(work, work_capacity * sizeof(*work));
+        }
+    }
+
+    item = &work[work_count++];
+    memset(item, 0, sizeof(*item));
+    item->sequence = sequence;
+    item->path = xrealloc(NULL, strlen(path) + 1);
+    strcpy(item->path, path);
+
+    if ((verdict = find_journal_entry(sequence, path))) {
+        item->verdict = verdict;
+        stats.files++;
+        stats.matches += (verdict == 's') == display_on_success;
+        return NULL;
+    }
+
+    return item;
+}
+
+/**
+ * Coordinate workers started with "--connect": read the input, hand out
+ * batches of paths to workers when they ask for them and report the results
+ * they send back in input order. The paths of a worker that disconnects
+ * before sending all of its results are handed out again.
+ *
+ * @param delimation          Way paths are delimited in the input.
+ * @param display_on_success  Indicates whether the names of files the
+ *                            COMMAND succeeded or failed on are displayed.
+ * @param json_output         Indicates whether JSON records are written.
+ *
+ * @return Exit status of the program.
+ */
+int serve(delimation_et delimation, int display_on_success, int json_output)
+{
+    char *batch;
+    size_t batch_capacity;
+    size_t batch_paths;
+    size_t batch_used;
+    char *end;
+    int fd;
+    int highest_fd;
+    size_t index;
+    work_item_st *item;
+    ssize_t length;
+    int listen_fd;
+    int match;
+    size_t needed;
+    char *path;
+    fd_set readable;
+    char *record;
+    char *record_end;
+    size_t requeued_capacity;
+    size_t requeued_count;
+    unsigned long long *requeued;
+    unsigned long long sequence;
+    struct timespec timeout;
+    worker_st *worker;
+    size_t worker_capacity;
+    size_t worker_count;
+    worker_st *workers;
+
+    int input_done = 0;
+    unsigned long next_worker_id = 1;
+    int non_fatal_errors = 0;
+    size_t outstanding = 0;
+
+    if ((listen_fd = open_socket(socket_path, 1)) == -1) {
+        perror(socket_path);
+        return 1;
+    }
+    atexit(remove_socket);
+
+    batch = NULL;
+    batch_capacity = 0;
+    requeued = NULL;
+    requeued_capacity = 0;
+    requeued_count = 0;
+    sequence = 0;
+    workers = NULL;
+    worker_capacity = 0;
+    worker_count = 0;
+
+    while (!input_done || requeued_count || work_head < work_count) {
+        // Workers that asked for paths get a batch of paths that were handed
+        // to a worker that went away, if any, and otherwise fresh input. When
+        // every path has been handed out, the request is answered with an
+        // empty batch once no other worker can go away with paths that would
+        // have to be handed out again.
+        for (worker = workers; worker < workers + worker_count; worker++) {
+            if (!worker->waiting) {
+                continue;
+            }
+
+            batch_used = 0;
+            for (batch_paths = 0; batch_paths < SERVE_BATCH; ) {
+                if (requeued_count) {
+                    item = find_work_item(requeued[--requeued_count]);
+                } else if (input_done) {
+                    break;
+                } else if (!(path = read_path(stdin, delimation))) {
+                    input_done = 1;
+                    break;
+                } else if (!(item = add_work_item(++sequence, path,
+                  display_on_success))) {
+                    continue;
+                }
+
+                item->worker = worker->id;
+                outstanding++;
+                needed = batch_used + strlen(item->path) + 32;
+                if (needed > batch_capacity) {
+                    batch_capacity = needed * 2;
+                    batch = xrealloc(batch, batch_capacity);
+                }
+                batch_used += (size_t) sprintf(batch + batch_used, "%llu %s",
+                    item->sequence, item->path) + 1;
+                batch_paths++;
+            }
+
+            if (!batch_paths && outstanding) {
+                continue;
+            }
+            if (!batch) {
+                batch_capacity = 1;
+                batch = xrealloc(NULL, batch_capacity);
+            }
+            batch[batch_used++] = '\0';
+            worker->waiting = 0;
+            if (send_all(worker->fd, batch, batch_used) == -1) {
+                // The worker is dropped when its socket is read next.
+                perror(socket_path);
+            }
+        }
+
+        // Results are reported in input order as soon as every path before
+        // them has been reported.
+        for (; work_head < work_count && work[work_head].verdict;
+          work_head++) {
+            item = &work[work_head];
+            match = item->verdict != 'e' && item->verdict != 'k' &&
+                (item->verdict == 's') == display_on_success;
+            if (json_output) {
+                write_json_result(item->path, item->verdict == 's' ?
+                    "success" : item->verdict == 'f' ? "failure" :
+                    item->verdict == 'e' ? "error" : "skipped", match, NULL,
+                    0, NULL, item->error);
+            } else if (match) {
+                fputs(item->path, stdout);
+                putchar(delimation == NULL_BYTE_DELIMATION ? '\0' : '\n');
+            }
+            free(item->path);
+            free(item->error);
+        }
+
+        if (input_done && !requeued_count && work_head == work_count) {
+            break;
+        }
+
+        fflush(stdout);
+        FD_ZERO(&readable);
+        FD_SET(listen_fd, &readable);
+        highest_fd = listen_fd;
+        for (worker = workers; worker < workers + worker_count; worker++) {
+            FD_SET(worker->fd, &readable);
+            highest_fd = worker->fd > highest_fd ? worker->fd : highest_fd;
+        }
+        timeout.tv_sec = 1;
+        timeout.tv_nsec = 0;
+        if (pselect(highest_fd + 1, &readable, NULL, NULL, &timeout,
+          &wait_mask) == -1) {
+            FD_ZERO(&readable);
+        }
+        check_progress();
+        check_metrics();
+        check_journal();
+
+        if (FD_ISSET(listen_fd, &readable) &&
+          (fd = accept(listen_fd, NULL, NULL)) != -1) {
+            if (worker_count == worker_capacity) {
+                worker_capacity = worker_capacity * 2 + 16;
+                workers = xrealloc(workers,
+                    worker_capacity * sizeof(*workers));
+            }
+            worker = &workers[worker_count++];
+            memset(worker, 0, sizeof(*worker));
+            worker->fd = fd;
+            worker->id = next_worker_id++;
+        }
+
+        for (index = 0; index < worker_count; index++) {
+            worker = &workers[index];
+            if (!FD_ISSET(worker->fd, &readable)) {
+                continue;
+            }
+
+            if (worker->capacity - worker->used < 4096) {
+                worker->capacity = worker->capacity * 2 + 4096;
+                worker->buffer = xrealloc(worker->buffer, worker->capacity);
+            }
+            length = read(worker->fd, worker->buffer + worker->used,
+                worker->capacity - worker->used);
+
+            // Paths a worker that went away did not report on are handed out
+            // again.
+            if (length <= 0) {
+                for (item = work + work_head; item < work + work_count;
+                  item++) {
+                    if (item->worker == worker->id && !item->verdict) {
+                        if (requeued_count == requeued_capacity) {
+                            requeued_capacity = requeued_capacity * 2 + 64;
+                            requeued = xrealloc(requeued,
+                                requeued_capacity * sizeof(*requeued));
+                        }
+                        requeued[requeued_count++] = item->sequence;
+                        item->worker = 0;
+                        outstanding--;
+                    }
+                }
+                close(worker->fd);
+                free(worker->buffer);
+                workers[index--] = workers[--worker_count];
+                continue;
+            }
+            worker->used += (size_t) length;
+
+            // An empty record is a request for paths and any other record is
+            // a result.
+            for (record = worker->buffer; (record_end = memchr(record, '\0',
+              (size_t) (worker->buffer + worker->used - record)));
+              record = record_end + 1) {
+                if (record == record_end) {
+                    worker->waiting = 1;
+                    continue;
+                }
+
+                item = find_work_item(strtoull(record, &end, 10));
+                item = *end == ' ' ? item : NULL;
+                if (!item || item->worker != worker->id || item->verdict) {
+                    fprintf(stderr, "%s: unexpected result from worker -- "
+                        "'%s'\n", socket_path, record);
+                    continue;
+                }
+
+                if (!strncmp(end + 1, "success", 7)) {
+                    item->verdict = 's';
+                } else if (!strncmp(end + 1, "failure", 7)) {
+                    item->verdict = 'f';
+                } else if (!strncmp(end + 1, "error", 5)) {
+                    item->verdict = 'e';
+                    if (end[6] == ' ') {
+                        item->error = xrealloc(NULL, strlen(end + 7) + 1);
+                        strcpy(item->error, end + 7);
+                    }
+                } else {
+                    item->verdict = 'k';
+                }
+
+                outstanding--;
+                stats.files++;
+                if (item->verdict == 'e') {
+                    non_fatal_errors = 1;
+                    stats.errors++;
+                } else if (item->verdict == 'k') {
+                    stats.skipped++;
+                } else {
+                    stats.matches += (item->verdict == 's') ==
+                        display_on_success;
+                    journal_result(item->sequence, item->path,
+                        item->verdict == 's');
+                }
+            }
+
+            worker->used -= (size_t) (record - worker->buffer);
+            memmove(worker->buffer, record, worker->used);
+        }
+    }
+
+    // Workers that are still connected learn that there is nothing left to
+    // do when the socket is closed.
+    for (worker = workers; worker < workers + worker_count; worker++) {
+        close(worker->fd);
+        free(worker->buffer);
+    }
+    close(listen_fd);
+    free(workers);
+    free(batch);
+    free(requeued);
+    return non_fatal_errors ? 2 : 0;
+}
+
+/**
+ * Join a directory and a name with a slash.
+ *
+ * @param directory  Path of the directory.
+ * @param name       Name of an entry of the directory.
+ *
+ * @return Newly allocated path.
+ */
+char *join_path(const char *directory, const char *name)
+{
+    size_t length;
+    char *path;
+
+    length = strlen(directory);
+    path = xrealloc(NULL, length + strlen(name) + 2);
+    memcpy(path, directory, length);
+    path[length] = '/';
+    strcpy(path + length + 1, name);
+    return path;
+}
+
+/**
+ * Add a path to the queue of "--watch". A file that is already at the end of
+ * the queue, which happens when it is written several times in a row, is not
+ * added again.
+ *
+ * @param path       Newly allocated path that is owned by the queue.
+ * @param directory  Indicates whether the path is a directory.
+ */
+void queue_watch_entry(char *path, int directory)
+{
+    watch_entry_st *last;
+
+    last = watch_queue + watch_queue_count;
+    if (!directory && watch_queue_count > watch_queue_head &&
+      !last[-1].directory && !strcmp(last[-1].path, path)) {
+        free(path);
+        return;
+    }
+
+    // Entries that have been taken are dropped once they make up most of the
+    // queue.
+    if (watch_queue_head > 1024 && watch_queue_head > watch_queue_count / 2) {
+        watch_queue_count -= watch_queue_head;
+        memmove(watch_queue, watch_queue + watch_queue_head,
+            watch_queue_count * sizeof(*watch_queue));
+        watch_queue_head = 0;
+    }
+    if (watch_queue_count == watch_queue_capacity) {
+        watch_queue_capacity = watch_queue_capacity * 2 + 1024;
+        watch_queue = xrealloc(watch_queue,
+            watch_queue_capacity * sizeof(*watch_queue));
+    }
+    watch_queue[watch_queue_count].path = path;
+    watch_queue[watch_queue_count].directory = directory;
+    watch_queue_count++;
+}
+
+/**
+ * Watch a directory and add its entries to the queue of "--watch". The
+ * directory is watched before it is listed so that files created in the
+ * meantime are not missed. Symbolic links to directories are not followed.
+ *
+ * @param path  Path of the directory.
+ */
+void scan_watch_directory(const char *path)
+{
+    char *child;
+    DIR *directory;
+    struct dirent *entry;
+    int is_directory;
+    struct stat status;
+    int wd;
+
+#ifdef __linux__
+    wd = inotify_add_watch(watch_fd, path, WATCH_EVENTS);
+#else
+    wd = -1;
+    errno = ENOSYS;
+#endif
+    if (wd == -1) {
+        perror(path);
+    } else {
+        // Watching a directory again, e.g. after events were lost, gives the
+        // same descriptor.
+        if ((size_t) wd >= watch_directory_capacity) {
+            watch_directories = xrealloc(watch_directories,
+                ((size_t) wd * 2 + 64) * sizeof(*watch_directories));
+            memset(watch_directories + watch_directory_capacity, 0,
+                ((size_t) wd * 2 + 64 - watch_directory_capacity) *
+                sizeof(*watch_directories));
+            watch_directory_capacity = (size_t) wd * 2 + 64;
+        }
+        watch_directory_count += !watch_directories[wd];
+        free(watch_directories[wd]);
+        watch_directories[wd] = xstrdup(path);
+    }
+
+    if (!(directory = opendir(path))) {
+        perror(path);
+        return;
+    }
+    while ((entry = readdir(directory))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        child = join_path(path, entry->d_name);
+        is_directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            is_directory = lstat(child, &status) == 0 &&
+                S_ISDIR(status.st_mode);
+        }
+        queue_watch_entry(child, is_directory);
+    }
+    closedir(directory);
+}
+
+/**
+ * Find a path in a hash table of the match set of "--watch".
+ *
+ * @param table     Entries of the table.
+ * @param capacity  Number of entries, which is a power of two.
+ * @param path      Path to look for.
+ *
+ * @return The entry holding the path or, when the path is not in the table,
+ * the first entry that is free or was removed where it could be added.
+ */
+char **watch_match_entry(char **table, size_t capacity, const char *path)
+{
+    char **entry;
+    size_t index;
+    char **removed;
+
+    removed = NULL;
+    for (index = (size_t) hash_path(path) & (capacity - 1); table[index];
+      index = (index + 1) & (capacity - 1)) {
+        entry = &table[index];
+        if (*entry == watch_removed) {
+            removed = removed ? removed : entry;
+        } else if (!strcmp(*entry, path)) {
+            return entry;
+        }
+    }
+
+    return removed ? removed : &table[index];
+}
+
+/**
+ * Add a path to the match set of "--watch" or remove it, and print the
+ * change, if any, as the path prefixed with "+" or "-".
+ *
+ * @param path        Path of the file.
+ * @param match       Indicates whether the file is a match. Files that were
+ *                    removed while the COMMAND ran are never matches.
+ * @param delimation  Delimation of the input, which is used for the output.
+ */
+void report_watch_match(const char *path, int match, delimation_et delimation)
+{
+    size_t capacity;
+    char **entry;
+    size_t index;
+    char **matches;
+
+    if (match && access(path, F_OK) == -1) {
+        match = 0;
+    }
+
+    // The table is rebuilt without removed entries before it is half full.
+    if (match && (watch_match_used + 1) * 2 > watch_match_capacity) {
+        matches = watch_matches;
+        capacity = watch_match_capacity;
+        for (watch_match_capacity = 64;
+          watch_match_capacity < (watch_match_count + 1) * 4;
+          watch_match_capacity *= 2);
+        watch_matches = xrealloc(NULL,
+            watch_match_capacity * sizeof(*watch_matches));
+        memset(watch_matches, 0,
+            watch_match_capacity * sizeof(*watch_matches));
+        for (index = 0; index < capacity; index++) {
+            if (matches[index] && matches[index] != watch_removed) {
+                *watch_match_entry(watch_matches, watch_match_capacity,
+                    matches[index]) = matches[index];
+            }
+        }
+        free(matches);
+        watch_match_used = watch_match_count;
+    }
+
+    entry = NULL;
+    if (watch_match_capacity) {
+        entry = watch_match_entry(watch_matches, watch_match_capacity, path);
+    }
+    if ((entry && *entry && *entry != watch_removed) == match) {
+        return;
+    }
+
+    // The path is printed first since it may be the entry that is removed.
+    putchar(match ? '+' : '-');
+    fputs(path, stdout);
+    putchar(delimation == NULL_BYTE_DELIMATION ? '\0' : '\n');
+    fflush(stdout);
+
+    if (match) {
+        watch_match_used += !*entry;
+        watch_match_count++;
+        *entry = xstrdup(path);
+    } else {
+        free(*entry);
+        *entry = watch_removed;
+        watch_match_count--;
+    }
+}
+
+/**
+ * Handle a directory that was removed from the tree watched by "--watch" or
+ * moved out of it: the files in it leave the match set, and it and the
+ * directories in it are no longer watched.
+ *
+ * @param directory   Path of the directory.
+ * @param delimation  Delimation of the input, which is used for the output.
+ */
+void forget_watch_directory(const char *directory, delimation_et delimation)
+{
+    size_t index;
+    size_t length;
+
+    length = strlen(directory);
+    for (index = 0; index < watch_match_capacity; index++) {
+        if (watch_matches[index] && watch_matches[index] != watch_removed &&
+          !strncmp(watch_matches[index], directory, length) &&
+          watch_matches[index][length] == '/') {
+            report_watch_match(watch_matches[index], 0, delimation);
+        }
+    }
+
+#ifdef __linux__
+    for (index = 0; index < watch_directory_capacity; index++) {
+        if (watch_directories[index] &&
+          !strncmp(watch_directories[index], directory, length) &&
+          (watch_directories[index][length] == '/' ||
+          !watch_directories[index][length])) {
+            inotify_rm_watch(watch_fd, (int) index);
+        }
+    }
+#endif
+}
+
+/**
+ * Read the pending events of "--watch". Files that were written or moved into
+ * the tree and new directories are queued, and files that were removed or
+ * moved out of the tree leave the match set right away.
+ *
+ * @param delimation  Delimation of the input, which is used for the output.
  */
-void usage(char *self)
+void read_watch_events(delimation_et delimation)
 {
-    printf(
-        "Usage: %s [OPTION] [!] COMMAND [ARGUMENT...]\n"
-        "\n"
-        "This tool reads a list of files from stdin, pipes the contents of "
-        "each file\ninto the specified command and prints the name of the "
-        "file if the command\nsucceeds. The name of the file is exposed to "
-        "the command via the environment\nvariable QUERY_FILENAME.\n"
-        "\n"
-        "Option parsing stops at the first non-option argument.\n"
-        "\n"
-        "Exit statuses:\n"
-        " 1     Fatal error encountered.\n"
-        " 2     Non-fatal error encountered.\n"
-        "\n"
-        "Options:\n"
-        " -!    Only print filenames when the COMMAND fails.\n"
-        " -0    File names are delimited by null bytes.\n"
-        " -h    Show this text and exit.\n"
-        " -n    File names are line-delimited. This the default behavior.\n"
-        " -s    Redirect stderr from the COMMAND to /dev/null.\n"
-        " -w    File names are delimited by ASCII whitespace.\n"
-        , self
-    );
+#ifdef __linux__
+    long buffer[8192];
+    struct inotify_event *event;
+    ssize_t length;
+    ssize_t offset;
+    char *path;
+
+    while ((length = read(watch_fd, buffer, sizeof(buffer))) > 0) {
+        for (offset = 0; offset < length;
+          offset += (ssize_t) (sizeof(*event) + event->len)) {
+            event = (struct inotify_event *) ((char *) buffer + offset);
+
+            // When the kernel dropped events, the whole tree is looked at
+            // again.
+            if (event->mask & IN_Q_OVERFLOW) {
+                queue_watch_entry(xstrdup(watch_root), 1);
+                continue;
+            } else if (event->wd < 0 ||
+              (size_t) event->wd >= watch_directory_capacity ||
+              !watch_directories[event->wd]) {
+                continue;
+            } else if (event->mask & IN_IGNORED) {
+                free(watch_directories[event->wd]);
+                watch_directories[event->wd] = NULL;
+                watch_directory_count--;
+                continue;
+            } else if (!event->len) {
+                continue;
+            }
+
+            path = join_path(watch_directories[event->wd], event->name);
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (event->mask & IN_ISDIR) {
+                    forget_watch_directory(path, delimation);
+                } else {
+                    report_watch_match(path, 0, delimation);
+                }
+                free(path);
+            } else if (event->mask & IN_ISDIR) {
+                queue_watch_entry(path, 1);
+            } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                queue_watch_entry(path, 0);
+            } else {
+                free(path);
+            }
+        }
+    }
+
+    if (length == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror(watch_root);
+        exit(1);
+    }
+#endif
 }
 
 /**
- * Free memory allocated for getline(3) and getdelim(3).
+ * Prepare "--watch": create the inotify(7) descriptor and queue the
+ * directory for the initial pass.
+ *
+ * @param root  Directory to watch.
+ *
+ * @return The descriptor or -1 on failure with errno set.
  */
-void free_line_buffer(void)
+int open_watch(const char *root)
 {
-    free(line);
+    struct stat status;
+
+    if (stat(root, &status) == -1) {
+        return -1;
+    } else if (!S_ISDIR(status.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+#ifdef __linux__
+    queue_watch_entry(xstrdup(root), 1);
+    return inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
 }
 
 /**
- * Handler for SIGUSR1 that makes the program exit with a status of 1. The
- * signal is sent by the child process after a fork to indicate that execvp(3)
- * failed which is a fatal error.
+ * Take the next file that "--watch" has to look at. Directories in the queue
+ * are watched and listed along the way.
+ *
+ * @param path        Set to the path, which is valid until the next call.
+ * @param delimation  Delimation of the input, which is used for the output.
+ *
+ * @return 1 when a path was taken, 0 when the watched directory is gone and
+ * -1 when there is nothing to do until "watch_fd" becomes readable.
  */
-void sigusr1_handler(int signal)
+int pull_watch_path(char **path, delimation_et delimation)
 {
-    exit(1);
+    watch_entry_st entry;
+
+    if (watch_queue_head == watch_queue_count ||
+      ++watch_polled == WATCH_POLL_PATHS) {
+        watch_polled = 0;
+        read_watch_events(delimation);
+    }
+
+    while (watch_queue_head < watch_queue_count) {
+        entry = watch_queue[watch_queue_head++];
+        if (!entry.directory) {
+            free(watch_path);
+            watch_path = entry.path;
+            *path = watch_path;
+            return 1;
+        }
+        scan_watch_directory(entry.path);
+        free(entry.path);
+    }
+
+    watch_queue_head = 0;
+    watch_queue_count = 0;
+    return watch_directory_count ? -1 : 0;
 }
 
 int main(int argc, char **argv)
 {
-    char *cursor;
+    char **arguments;
+    struct rusage child_usage;
     int dev_null_fd;
-    char *eol;
+    char *end;
+    int error_number;
     int errout_fd;
     struct stat file_status;
-    const char *getline_function;
+    int head_fd;
+    size_t index;
+    int input_done;
     int input_fd;
-    ssize_t line_length;
+    int lookup_result;
+    long mode;
+    struct stat newer_status;
+    int match;
     int option;
+    char *path;
+    int predicate;
+    int pulled;
+    size_t path_offset;
+    pid_t pid;
     int return_code;
-    pid_t status;
+    unsigned long long sequence;
+    double seconds;
+    struct sigaction signal_action;
+    slot_st *slot;
+    long long span_start;
+    long long spawn_time;
+    int status;
+    const char *status_span;
+    struct stat stdin_status;
+    long long size;
+    long value;
+    char verdict;
+    long long wall_us;
 
+    int batch_mode = 0;
+    int chain = 0;
     delimation_et delimation = LINE_DELIMATION;
     int display_on_success = 1;
-    size_t buffer_length = 0;
+    int json_output = 0;
+    int no_stat = 0;
+    int no_stdin = 0;
     int non_fatal_errors = 0;
+    int pin_cpus = 0;
     int redirect_stderr = 0;
+    int resume = 0;
+    int serve_mode = 0;
+    int worker_mode = 0;
+    int template_mode = 0;
+    int truncate_journal = 0;
 
-    while ((option = getopt(argc, argv, "+!0hnsw")) != -1) {
+    while ((option = getopt_long(argc, argv, "+!0hj:nstwX", long_options,
+      NULL)) != -1) {
         switch (option) {
           case '!':
             display_on_success = 0;
@@ -120,15 +4640,216 @@ int main(int argc, char **argv)
           case 'h':
             usage(argv[0]);
             return 0;
+          case 'j':
+            if (!strcmp(optarg, "auto")) {
+                auto_jobs = 1;
+                break;
+            }
+            value = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || value < 0 ||
+              value > MAXIMUM_JOBS) {
+                fprintf(stderr, "%s: invalid job count -- '%s'\n", argv[0],
+                    optarg);
+                return 1;
+            }
+            auto_jobs = 0;
+            jobs = (int) value;
+            break;
           case 'n':
             delimation = LINE_DELIMATION;
             break;
           case 's':
             redirect_stderr = 1;
             break;
+          case 't':
+            template_mode = 1;
+            break;
           case 'w':
             delimation = ASCII_WHITESPACE_DELIMATION;
             break;
+          case 'X':
+            batch_mode = 1;
+            no_stdin = 1;
+            break;
+          case CHAIN_OPTION:
+            chain = 1;
+            break;
+          case CONNECT_OPTION:
+          case SERVE_OPTION:
+            socket_path = optarg;
+            serve_mode = option == SERVE_OPTION;
+            worker_mode = option == CONNECT_OPTION;
+            break;
+          case EXCLUDE_OPTION:
+            add_path_pattern(&exclude_pattern, glob_to_regex(optarg), 1);
+            break;
+          case EXCLUDE_REGEX_OPTION:
+            add_path_pattern(&exclude_pattern, optarg, 0);
+            break;
+          case HEAD_OPTION:
+            if (parse_size(optarg, &head_limit) == -1) {
+                fprintf(stderr, "%s: invalid size -- '%s'\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+          case INCLUDE_OPTION:
+            add_path_pattern(&include_pattern, glob_to_regex(optarg), 1);
+            break;
+          case INCLUDE_REGEX_OPTION:
+            add_path_pattern(&include_pattern, optarg, 0);
+            break;
+          case IOPRIO_OPTION:
+#ifdef SYS_ioprio_set
+            if (parse_ioprio(optarg) == -1) {
+                fprintf(stderr, "%s: invalid IO priority -- '%s'\n",
+                    argv[0], optarg);
+                return 1;
+            }
+            break;
+#else
+            fputs("--ioprio is not supported on this platform.\n", stderr);
+            return 1;
+#endif
+          case JOURNAL_OPTION:
+            journal_path = optarg;
+            break;
+          case JSON_OPTION:
+            json_output = 1;
+            break;
+          case MAGIC_OPTION:
+            if (parse_magic(optarg) == -1) {
+                fprintf(stderr, "%s: invalid signature -- '%s'\n", argv[0],
+                    optarg);
+                return 1;
+            }
+            break;
+          case MAX_RATE_OPTION:
+            spawn_bucket.rate = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || !(spawn_bucket.rate > 0)) {
+                fprintf(stderr, "%s: invalid rate -- '%s'\n", argv[0],
+                    optarg);
+                return 1;
+            }
+            break;
+          case MAX_READ_RATE_OPTION:
+            if (parse_size(optarg, &size) == -1 || !size) {
+                fprintf(stderr, "%s: invalid rate -- '%s'\n", argv[0],
+                    optarg);
+                return 1;
+            }
+            read_bucket.rate = (double) size;
+            break;
+          case METRICS_FILE_OPTION:
+            metrics_path = optarg;
+            metrics_temporary_path = xrealloc(NULL, strlen(optarg) + 5);
+            strcpy(metrics_temporary_path, optarg);
+            strcat(metrics_temporary_path, ".tmp");
+            break;
+          case MODE_OPTION:
+            mode_filter_kind = '=';
+            if (optarg[0] == '-' || optarg[0] == '/') {
+                mode_filter_kind = optarg[0];
+            }
+            mode = strtol(optarg + (mode_filter_kind != '='), &end, 8);
+            if (end == optarg + (mode_filter_kind != '=') || *end != '\0' ||
+              mode < 0 || mode > 07777) {
+                fprintf(stderr, "%s: invalid mode -- '%s'\n", argv[0], optarg);
+                return 1;
+            }
+            mode_filter = (mode_t) mode;
+            break;
+          case NEWER_OPTION:
+            if (stat(optarg, &newer_status) == -1) {
+                perror(optarg);
+                return 1;
+            }
+            newer_filter = 1;
+            newer_than = newer_status.st_mtim;
+            break;
+          case NICE_OPTION:
+            value = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || value < -40 || value > 40) {
+                fprintf(stderr, "%s: invalid niceness -- '%s'\n", argv[0],
+                    optarg);
+                return 1;
+            }
+            child_nice = (int) value;
+            break;
+          case NO_STAT_OPTION:
+            no_stat = 1;
+            // fall through
+          case NO_STDIN_OPTION:
+            no_stdin = 1;
+            break;
+          case OUTPUT_OPTION:
+            if (query_output_count == MAXIMUM_PREDICATES) {
+                fputs("Too many outputs.\n", stderr);
+                return 1;
+            }
+            query_output_paths[query_output_count++] = optarg;
+            break;
+          case PIN_CPUS_OPTION:
+            pin_cpus = 1;
+            break;
+          case PROGRESS_OPTION:
+            seconds = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || !(seconds > 0)) {
+                fprintf(stderr, "%s: invalid progress interval -- '%s'\n",
+                    argv[0], optarg);
+                return 1;
+            }
+            progress_interval = (long long) (seconds * 1e6);
+            progress_interval = progress_interval ? progress_interval : 1;
+            break;
+          case RESUME_OPTION:
+            resume = 1;
+            break;
+          case RLIMIT_OPTION:
+            if (parse_rlimit(optarg) == -1) {
+                fprintf(stderr, "%s: invalid resource limit -- '%s'\n",
+                    argv[0], optarg);
+                return 1;
+            }
+            break;
+          case SHARD_OPTION:
+            if (parse_shard(optarg) == -1) {
+                fprintf(stderr, "%s: invalid shard -- '%s'\n", argv[0],
+                    optarg);
+                return 1;
+            }
+            break;
+          case SIZE_MAX_OPTION:
+          case SIZE_MIN_OPTION:
+            if (parse_size(optarg, option == SIZE_MAX_OPTION ? &size_maximum :
+              &size_minimum) == -1) {
+                fprintf(stderr, "%s: invalid size -- '%s'\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+          case TYPE_OPTION:
+            if (!optarg[0] || strspn(optarg, "fpcbs") != strlen(optarg)) {
+                fprintf(stderr, "%s: invalid type list -- '%s'\n", argv[0],
+                    optarg);
+                return 1;
+            }
+            type_filter = optarg;
+            break;
+          case TRACE_OPTION:
+            if (!(trace_file = fopen(optarg, "w"))) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+          case TRUNCATE_JOURNAL_OPTION:
+            truncate_journal = 1;
+            break;
+          case WATCH_OPTION:
+            // Trailing slashes are dropped so that reported paths do not
+            // contain "//".
+            watch_root = optarg;
+            for (index = strlen(optarg); index > 1 &&
+              optarg[index - 1] == '/'; optarg[--index] = '\0');
+            break;
           case '+':
             // Using "+" to ensure POSIX-style argument parsing is a GNU
             // extension, so an explicit check for "+" as a flag is added for
@@ -145,161 +4866,578 @@ int main(int argc, char **argv)
         optind++;
     }
 
-    if (optind >= argc) {
+    if (optind >= argc && !serve_mode) {
         fputs("No command specified.\n", stderr);
         return 1;
-    } else if ((dev_null_fd = open("/dev/null", O_WRONLY)) == -1) {
+    } else if (optind < argc && serve_mode) {
+        fputs("--serve does not take a COMMAND.\n", stderr);
+        return 1;
+    } else if (worker_mode && (batch_mode || journal_path || shard_count)) {
+        fputs("--connect cannot be used with -X, --journal or --shard.\n",
+            stderr);
+        return 1;
+    } else if (no_stdin && magic_count) {
+        fputs("--magic cannot be used with --no-stdin or -X.\n", stderr);
+        return 1;
+    } else if (no_stdin && head_limit != -1) {
+        fputs("--head cannot be used with --no-stdin or -X.\n", stderr);
+        return 1;
+    } else if (no_stat && (size_minimum != -1 || size_maximum != -1 ||
+      newer_filter || mode_filter_kind || type_filter)) {
+        fputs("--no-stat cannot be used with metadata filters.\n", stderr);
+        return 1;
+    } else if (no_stat && read_bucket.rate) {
+        fputs("--max-read-rate cannot be used with --no-stat.\n", stderr);
+        return 1;
+    } else if (resume && !journal_path) {
+        fputs("--resume cannot be used without --journal.\n", stderr);
+        return 1;
+    } else if (truncate_journal && (!journal_path || resume)) {
+        fputs("--truncate-journal needs --journal and cannot be used with "
+            "--resume.\n", stderr);
+        return 1;
+    } else if (batch_mode && (auto_jobs || (jobs != -1 && jobs != 1))) {
+        fputs("-j cannot be used with -X.\n", stderr);
+        return 1;
+    } else if (batch_mode && template_mode) {
+        fputs("-t cannot be used with -X.\n", stderr);
+        return 1;
+    } else if (template_mode && prepare_template(&argv[optind]) && no_stat) {
+        fputs("{size} cannot be used with --no-stat.\n", stderr);
+        return 1;
+    } else if (!serve_mode && parse_predicates(&argv[optind], chain) == -1) {
+        return 1;
+    } else if (batch_mode && predicate_count > 1) {
+        fputs("--and, --or and --next cannot be used with -X.\n", stderr);
+        return 1;
+    } else if (query_output_count && query_count < 2) {
+        fputs("--output cannot be used without --next.\n", stderr);
+        return 1;
+    } else if (query_count > 1 && query_output_count != query_count) {
+        fputs("Every query separated by --next needs an --output FILE.\n",
+            stderr);
+        return 1;
+    } else if (query_count > 1 && (json_output || journal_path ||
+      worker_mode)) {
+        fputs("--next cannot be used with --json, --journal or --connect.\n",
+            stderr);
+        return 1;
+    } else if (watch_root && (batch_mode || json_output || journal_path ||
+      query_count > 1 || worker_mode || serve_mode)) {
+        fputs("--watch cannot be used with -X, --json, --journal, --next, "
+            "--connect or\n--serve.\n", stderr);
+        return 1;
+    } else if ((dev_null_fd = open("/dev/null", O_RDWR)) == -1) {
         perror("/dev/null");
         return 1;
-    } else if (signal(SIGUSR1, sigusr1_handler) == SIG_ERR) {
-        perror("signal");
+    }
+
+    for (index = 0; index < query_output_count; index++) {
+        if (!(query_outputs[index] = fopen(query_output_paths[index], "w"))) {
+            perror(query_output_paths[index]);
+            return 1;
+        }
+    }
+
+    // SIGCHLD, SIGUSR1 and SIGUSR2 are only unblocked while waiting on
+    // children. Collected children are also checked for a pending SIGUSR1.
+    memset(&signal_action, 0, sizeof(signal_action));
+    sigemptyset(&signal_action.sa_mask);
+    signal_action.sa_flags = SA_RESTART;
+    signal_action.sa_handler = sigchld_handler;
+    if (sigaction(SIGCHLD, &signal_action, NULL) == -1) {
+        perror("sigaction");
+        return 1;
+    }
+    signal_action.sa_handler = sigusr1_handler;
+    if (sigaction(SIGUSR1, &signal_action, NULL) == -1) {
+        perror("sigaction");
+        return 1;
+    }
+    signal_action.sa_handler = sigusr2_handler;
+    if (sigaction(SIGUSR2, &signal_action, NULL) == -1) {
+        perror("sigaction");
+        return 1;
+    }
+
+    sigemptyset(&wait_mask);
+    sigaddset(&wait_mask, SIGCHLD);
+    sigaddset(&wait_mask, SIGUSR1);
+    sigaddset(&wait_mask, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &wait_mask, &original_mask) == -1) {
+        perror("sigprocmask");
         return 1;
     }
+    wait_mask = original_mask;
+    sigdelset(&wait_mask, SIGCHLD);
+    sigdelset(&wait_mask, SIGUSR1);
+    sigdelset(&wait_mask, SIGUSR2);
+
+    // The ETA in progress reports can only be computed when the size of the
+    // input is known ahead of time.
+    if (!watch_root && fstat(STDIN_FILENO, &stdin_status) == 0 &&
+      S_ISREG(stdin_status.st_mode)) {
+        stats.input_size = (long long) stdin_status.st_size;
+        stats.input_size -= (long long) lseek(STDIN_FILENO, 0, SEEK_CUR);
+    }
+
+    stats.start = monotonic_us();
+    progress_previous_time = stats.start;
+    progress_due = stats.start + progress_interval;
+    metrics_due = stats.start + METRICS_INTERVAL;
 
-    if (delimation == NULL_BYTE_DELIMATION) {
-        getline_function = "getdelim";
+    // With "-j auto", the limit starts at one child and is raised by the
+    // controller up to four children per CPU, which leaves room for commands
+    // that mostly wait on IO. Without "-j", or with "-j 0", there is one child
+    // per CPU, and batch mode runs one batch at a time. Either way, only the
+    // CPUs query is allowed to run on and its cgroup quota count.
+    if (auto_jobs) {
+        maximum_jobs = 4 * cpu_count();
+        maximum_jobs = maximum_jobs < MAXIMUM_JOBS ? maximum_jobs :
+            MAXIMUM_JOBS;
+        jobs = 1;
+        control_previous_time = stats.start;
+        control_due = stats.start + CONTROL_INTERVAL;
+        sample_pressure(0);
+        sample_utilization();
     } else {
-        getline_function = "getline";
+        jobs = batch_mode ? 1 : jobs > 0 ? jobs : cpu_count();
+        maximum_jobs = jobs;
+    }
+    slots = xrealloc(NULL, maximum_jobs * sizeof(*slots));
+    memset(slots, 0, maximum_jobs * sizeof(*slots));
+
+    if (pin_cpus && prepare_pinning() == -1) {
+        perror("--pin-cpus");
+        return 1;
+    }
+
+    // Buckets start full and hold a tenth of a second worth of tokens, or a
+    // single spawn, so bursts stay short.
+    spawn_bucket.capacity = spawn_bucket.rate > 10 ? spawn_bucket.rate / 10 : 1;
+    spawn_bucket.tokens = spawn_bucket.capacity;
+    spawn_bucket.updated = stats.start;
+    read_bucket.capacity = read_bucket.rate / 10;
+    read_bucket.tokens = read_bucket.capacity;
+    read_bucket.updated = stats.start;
+
+    // The journal of an earlier run is only discarded with
+    // "--truncate-journal" so a forgotten "--resume" does not lose it.
+    if (resume && load_journal(journal_path) == -1) {
+        perror(journal_path);
+        return 1;
+    } else if (journal_path && ((journal_fd = open(journal_path,
+      O_WRONLY | O_CREAT | O_APPEND, 0666)) == -1 ||
+      fstat(journal_fd, &file_status) == -1)) {
+        perror(journal_path);
+        return 1;
+    } else if (journal_path && !resume && file_status.st_size > 0) {
+        if (!truncate_journal) {
+            fprintf(stderr, "%s: journal is not empty; use --resume or "
+                "--truncate-journal\n", journal_path);
+            return 1;
+        } else if (ftruncate(journal_fd, 0) == -1) {
+            perror(journal_path);
+            return 1;
+        }
     }
+    journal_due = stats.start + JOURNAL_INTERVAL;
 
+    compile_path_patterns();
+    batch_limit = batch_argument_limit(&argv[optind]);
     errout_fd = redirect_stderr ? dev_null_fd : STDERR_FILENO;
     atexit(free_line_buffer);
+    atexit(write_trace);
+    atexit(write_metrics);
+    atexit(write_journal);
 
-next_line:
-    // There is no signal handling or EINTR retry logic because under normal
-    // operation, the only command that could possibly be interrupted by an
-    // expected syscall is close(2) on a file opened with O_RDONLY.
-    while (1) {
-        if (delimation == NULL_BYTE_DELIMATION) {
-            line_length = getdelim(&line, &buffer_length, (int) '\0', stdin);
-        } else {
-            line_length = getline(&line, &buffer_length, stdin);
-        }
+    if (serve_mode) {
+        return serve(delimation, display_on_success, json_output);
+    } else if (worker_mode && ((worker_fd = open_socket(socket_path, 0)) ==
+      -1 || fcntl(worker_fd, F_SETFL, O_NONBLOCK) == -1)) {
+        perror(socket_path);
+        return 1;
+    } else if (watch_root && (watch_fd = open_watch(watch_root)) == -1) {
+        perror(watch_root);
+        return 1;
+    }
 
-        if (line_length == -1) {
-            if (feof(stdin)) {
-                break;
-            }
-            perror(getline_function);
+    // There is no EINTR retry logic because the signals handled by the parent
+    // are blocked outside of pselect(2).
+    input_done = 0;
+    sequence = 0;
+    while (!input_done || running_children) {
+        // Children that have exited are collected before more input is read.
+        // When every slot is busy or the input has been consumed, the parent
+        // sleeps until a child exits, and when a rate limit applies, until
+        // it allows the next file. Results are reported in the order the
+        // children exit.
+        pid = 0;
+        if (running_children &&
+          (pid = wait4(-1, &status, WNOHANG, &child_usage)) == -1) {
+            perror("wait4");
             return 1;
-        } else {
-            eol = line + line_length;
-        }
+        } else if (pid == 0 && (input_done || running_children >= jobs ||
+          rate_limited())) {
+            wait_for_signal(-1);
+            continue;
+        } else if (pid != 0) {
+            check_exec_failure();
+            for (slot = slots; slot < slots + maximum_jobs &&
+              slot->pid != pid; slot++);
 
-        // When using line and whitespace delimation, insert null bytes so that
-        // a pointer to the beginning of the field can be used to represent the
-        // path of the file being opened.
-        if (delimation == LINE_DELIMATION) {
-            if (line[line_length - 1] == '\n') {
-                line[line_length - 1] = '\0';
+            if (slot == slots + maximum_jobs) {
+                continue;
+            } else if (WIFEXITED(status)) {
+                return_code = WEXITSTATUS(status);
+            } else if (WIFSIGNALED(status)) {
+                return_code = WTERMSIG(status) + 128;
+            } else {
+                continue;
             }
-        } else if (delimation == ASCII_WHITESPACE_DELIMATION) {
-            for (cursor = line; cursor < eol; cursor++) {
-                if (isspace(*cursor)) {
-                    *cursor = '\0';
+
+            wall_us = monotonic_us() - slot->start;
+            observe_child(wall_us);
+            span_start = trace_span("child", slot->span_start,
+                (int) (slot - slots), slot->path_offset);
+
+            // In a predicate chain, the next COMMAND that can still change
+            // the outcome runs on the same file in the same slot.
+            if (predicate_count > 1 && (predicate = next_predicate(slot,
+              return_code == EXIT_SUCCESS, wall_us)) != -1) {
+                if (setenv("QUERY_FILENAME", slot->path, 1) == -1) {
+                    perror("setenv");
+                    return 1;
+                }
+                arguments = &argv[optind];
+                if (template_mode) {
+                    arguments = expand_template(slot->path, slot->size);
+                }
+                if (slot->input_fd != -1) {
+                    lseek(slot->input_fd, 0, SEEK_SET);
+                }
+                slot->start = monotonic_us();
+                slot->pid = spawn_child(
+                    arguments + predicates[predicate].offset, slot->input_fd,
+                    dev_null_fd, errout_fd, (int) (slot - slots));
+                spawn_bucket.tokens--;
+                slot->span_start = trace_span("spawn", span_start, -1,
+                    slot->path_offset);
+                continue;
+            } else if (predicate_count > 1) {
+                return_code = slot->verdicts & 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+                if (slot->input_fd != -1) {
+                    close(slot->input_fd);
                 }
             }
-        }
 
-        cursor = line;
-        while (cursor < eol) {
-            if (delimation == ASCII_WHITESPACE_DELIMATION) {
-                // Move the cursor to the beginning of the next word.
-                for (; !(*cursor); cursor++) {
-                    if (cursor >= eol) {
-                        goto next_line;
+            slot->pid = 0;
+            running_children--;
+
+            // In fan-out mode, the name of the file is written to the output
+            // of every query that matches it.
+            if (query_count > 1) {
+                stats.files++;
+                for (index = 0; index < query_count; index++) {
+                    match = (int) (slot->verdicts >> index & 1) ==
+                        display_on_success;
+                    stats.matches += match;
+                    if (match) {
+                        fputs(slot->path, query_outputs[index]);
+                        putc(delimation == NULL_BYTE_DELIMATION ? '\0' : '\n',
+                            query_outputs[index]);
                     }
                 }
-            } else if (*cursor == '\0') {
-                break;
+                trace_span("output", span_start, -1, slot->path_offset);
+                check_progress();
+                check_metrics();
+                check_concurrency();
+                continue;
             }
 
-            // Attempt to open the path represented by the input, verify that
-            // the path is not a folder and set the QUERY_FILENAME environment
-            // variable.
-            if ((input_fd = open(cursor, O_RDONLY)) == -1) {
-                non_fatal_errors = 1;
-                perror(cursor);
-                if (delimation == ASCII_WHITESPACE_DELIMATION) {
-                    goto next_word;
-                }
-                break;
-            } else if (fstat(input_fd, &file_status) == -1) {
-                perror(cursor);
-                return 1;
-            } else if (S_ISDIR(file_status.st_mode)) {
-                non_fatal_errors = 1;
-                fprintf(stderr, "%s: %s\n", cursor, strerror(EISDIR));
-                if (delimation == ASCII_WHITESPACE_DELIMATION) {
-                    goto next_word;
+            match = (display_on_success && return_code == EXIT_SUCCESS) ||
+                (!display_on_success && return_code != EXIT_SUCCESS);
+            stats.files++;
+            stats.matches += match;
+            journal_result(slot->sequence, slot->path,
+                return_code == EXIT_SUCCESS);
+
+            if (worker_fd != -1) {
+                send_result(slot->sequence,
+                    return_code == EXIT_SUCCESS ? "success" : "failure", NULL);
+            } else if (json_output) {
+                write_json_result(slot->path,
+                    return_code == EXIT_SUCCESS ? "success" : "failure",
+                    match, &status, wall_us, &child_usage, NULL);
+            } else if (watch_fd != -1) {
+                if (!slot->stale) {
+                    report_watch_match(slot->path, match, delimation);
                 }
-                break;
-            } else if (setenv("QUERY_FILENAME", cursor, 1) == -1) {
-                perror("setenv");
-                return 1;
+            } else if (match) {
+                fputs(slot->path, stdout);
+                putchar(delimation == NULL_BYTE_DELIMATION ? '\0' : '\n');
             }
 
-            switch (fork()) {
-              case -1:
-                perror("fork");
-                return 1;
+            trace_span("output", span_start, -1, slot->path_offset);
+            check_progress();
+            check_metrics();
+            check_concurrency();
+            continue;
+        }
 
-              case 0:
-                // Replace the inherited stdin with the descriptor for the
-                // queried file then exec the command.
-                if ((dup2(input_fd, STDIN_FILENO) == -1) ||
-                    (dup2(dev_null_fd, STDOUT_FILENO) == -1) ||
-                    (dup2(errout_fd, STDERR_FILENO) == -1)) {
+        // Workers wait for the coordinator to send paths while their
+        // children run, and so does "--watch" for files to change.
+        if (worker_fd != -1) {
+            if ((pulled = pull_path(&path, &sequence)) == -1) {
+                wait_for_signal(worker_fd);
+                continue;
+            } else if (!pulled) {
+                input_done = 1;
+                continue;
+            }
+        } else if (watch_fd != -1) {
+            if ((pulled = pull_watch_path(&path, delimation)) == -1) {
+                wait_for_signal(watch_fd);
+                continue;
+            } else if (!pulled) {
+                input_done = 1;
+                continue;
+            }
+            sequence++;
 
-                    perror("dup2");
-                    kill(getppid(), SIGUSR1);
-                    return 1;
-                }
-                execvp(argv[optind], &argv[optind]);
-                perror(argv[optind]);
-                kill(getppid(), SIGUSR1);
-                return 1;
+            // Children still looking at an older version of the file must
+            // not overwrite the result for the newest one.
+            for (slot = slots; slot < slots + maximum_jobs; slot++) {
+                slot->stale |= slot->pid && !strcmp(slot->path, path);
+            }
+        } else if (!(path = read_path(stdin, delimation))) {
+            input_done = 1;
+            continue;
+        } else {
+            sequence++;
+        }
 
-              default:
+        // Paths in other shards are left to other instances of query and are
+        // not reported at all. Positions in the journal count every path in
+        // the input so that they do not depend on the shard.
+        if (shard_count && !in_shard(path)) {
+            continue;
+        }
+
+        // With "--resume", files the journal has a result for are reported
+        // again without being queried.
+        if ((verdict = find_journal_entry(sequence, path))) {
+            match = (verdict == 's') == display_on_success;
+            stats.files++;
+            stats.matches += match;
+            if (json_output) {
+                write_json_result(path, verdict == 's' ? "success" :
+                    "failure", match, NULL, 0, NULL, NULL);
+            } else if (match) {
+                fputs(path, stdout);
+                putchar(delimation == NULL_BYTE_DELIMATION ? '\0' : '\n');
+            }
+            continue;
+        }
+
+        // Paths rejected by patterns are skipped before any system calls are
+        // made for them.
+        input_fd = -1;
+        if ((include_pattern || exclude_pattern) &&
+          !passes_path_filters(path)) {
+            goto skip;
+        }
+
+        // Attempt to open the path represented by the input, verify that
+        // the path is not a folder and set the QUERY_FILENAME environment
+        // variable. With "--no-stdin", the file is never opened, which saves
+        // a round trip on network file systems and leaves its access time
+        // alone.
+        path_offset = trace_path(path);
+        span_start = trace_clock();
+        if (no_stdin) {
+            lookup_result = no_stat ? 0 : stat(path, &file_status);
+            status_span = "stat";
+        } else {
+            lookup_result = input_fd = open(path, O_RDONLY);
+            span_start = trace_span("open", span_start, -1, path_offset);
+            status_span = "fstat";
+        }
+
+        if (lookup_result == -1 && watch_fd != -1 && errno == ENOENT) {
+            // Files that are removed before they are looked at are common
+            // with "--watch", e.g. temporary files, and are not errors.
+            report_watch_match(path, 0, delimation);
+            continue;
+        } else if (lookup_result == -1) {
+            error_number = errno;
+            non_fatal_errors = 1;
+            stats.files++;
+            stats.errors++;
+            perror(path);
+            if (worker_fd != -1) {
+                send_result(sequence, "error", strerror(error_number));
+            } else if (json_output) {
+                write_json_result(path, "error", 0, NULL, 0, NULL,
+                    strerror(error_number));
+            } else if (watch_fd != -1) {
+                report_watch_match(path, 0, delimation);
+            }
+            continue;
+        } else if (input_fd != -1 && fstat(input_fd, &file_status) == -1) {
+            perror(path);
+            return 1;
+        } else if (!no_stat && !passes_metadata_filters(&file_status)) {
+            trace_span(status_span, span_start, -1, path_offset);
+            goto skip;
+        } else if (!no_stat && S_ISDIR(file_status.st_mode)) {
+            non_fatal_errors = 1;
+            stats.files++;
+            stats.errors++;
+            if (input_fd != -1) {
                 close(input_fd);
             }
+            fprintf(stderr, "%s: %s\n", path, strerror(EISDIR));
+            if (worker_fd != -1) {
+                send_result(sequence, "error", strerror(EISDIR));
+            } else if (json_output) {
+                write_json_result(path, "error", 0, NULL, 0, NULL,
+                    strerror(EISDIR));
+            }
+            continue;
+        }
 
-            // Wait on the child to exit, check its return code and display the
-            // file name when the proper conditions are met.
-            while (1) {
-                if (wait(&status) == -1) {
-                    perror("wait");
-                    return 1;
-                }
+        span_start = trace_span(status_span, span_start, -1, path_offset);
 
-                if (WIFEXITED(status)) {
-                    return_code = WEXITSTATUS(status);
-                } else if (WIFSIGNALED(status)) {
-                    return_code = WTERMSIG(status) + 128;
-                } else {
-                    continue;
-                }
+        if (magic_count) {
+            match = matches_magic(input_fd);
+            span_start = trace_span("magic", span_start, -1, path_offset);
+            if (!match) {
+                goto skip;
+            }
+        }
 
-                if ((display_on_success && return_code == EXIT_SUCCESS) ||
-                   (!display_on_success && return_code != EXIT_SUCCESS)) {
-                    if (delimation == NULL_BYTE_DELIMATION) {
-                        fwrite(line, (size_t) line_length, 1, stdout);
-                    } else {
-                        puts(cursor);
-                    }
+        // Regular files that are no larger than the limit are given to the
+        // COMMAND as they are.
+        if (head_limit != -1 && (!S_ISREG(file_status.st_mode) ||
+          file_status.st_size > head_limit)) {
+            head_fd = head_input(input_fd);
+            span_start = trace_span("head", span_start, -1, path_offset);
+            error_number = errno;
+            close(input_fd);
+            input_fd = head_fd;
+
+            if (input_fd == -1) {
+                non_fatal_errors = 1;
+                stats.files++;
+                stats.errors++;
+                fprintf(stderr, "%s: %s\n", path, strerror(error_number));
+                if (worker_fd != -1) {
+                    send_result(sequence, "error", strerror(error_number));
+                } else if (json_output) {
+                    write_json_result(path, "error", 0, NULL, 0, NULL,
+                        strerror(error_number));
                 }
+                continue;
+            }
+        }
 
-                break;
+        // Every COMMAND of a predicate chain reads the file from the start, so
+        // it has to be possible to rewind the file.
+        if (predicate_count > 1 && input_fd != -1 &&
+          lseek(input_fd, 0, SEEK_CUR) == -1) {
+            error_number = errno;
+            non_fatal_errors = 1;
+            stats.files++;
+            stats.errors++;
+            close(input_fd);
+            fprintf(stderr, "%s: %s\n", path, strerror(error_number));
+            if (worker_fd != -1) {
+                send_result(sequence, "error", strerror(error_number));
+            } else if (json_output) {
+                write_json_result(path, "error", 0, NULL, 0, NULL,
+                    strerror(error_number));
+            }
+            continue;
+        }
+
+        // The read rate limit is charged with the number of bytes the COMMAND
+        // can read from the file, which is unknown for files other than
+        // regular files unless "--head" is used.
+        if (read_bucket.rate) {
+            size = S_ISREG(file_status.st_mode) ? file_status.st_size : 0;
+            if (head_limit != -1 && (size > head_limit ||
+              !S_ISREG(file_status.st_mode))) {
+                size = head_limit;
             }
+            read_bucket.tokens -= (double) size;
+        }
 
-            if (delimation != ASCII_WHITESPACE_DELIMATION) {
-                break;
+        // In batch mode, a path that does not fit in the argument list of the
+        // COMMAND starts the next batch once the current one has run.
+        if (batch_mode) {
+            if (!add_to_batch(path, sequence)) {
+                non_fatal_errors |= run_batch(&argv[optind], dev_null_fd,
+                    errout_fd, delimation, display_on_success, json_output);
+                add_to_batch(path, sequence);
             }
+            continue;
+        }
+
+        if (setenv("QUERY_FILENAME", path, 1) == -1) {
+            perror("setenv");
+            return 1;
+        }
 
-next_word:
-            // Move the cursor to the end of the current word.
-            for (; *cursor; cursor++);
+        // Placeholders are substituted in the parent so the child only has
+        // to exec.
+        arguments = &argv[optind];
+        if (template_mode) {
+            arguments = expand_template(path,
+                no_stat ? -1 : (long long) file_status.st_size);
         }
+
+        slot = free_slot();
+        predicate = predicate_count > 1 ? first_predicate(slot) : 0;
+        spawn_time = monotonic_us();
+        pid = spawn_child(arguments + predicates[predicate].offset, input_fd,
+            dev_null_fd, errout_fd, (int) (slot - slots));
+
+        // The file stays open for the rest of a predicate chain.
+        if (predicate_count > 1) {
+            slot->input_fd = input_fd;
+            slot->size = no_stat ? -1 : (long long) file_status.st_size;
+        } else if (input_fd != -1) {
+            close(input_fd);
+        }
+        claim_slot(slot, pid, path, spawn_time);
+        slot->sequence = sequence;
+        spawn_bucket.tokens--;
+        slot->span_start = trace_span("spawn", span_start, -1, path_offset);
+        slot->path_offset = path_offset;
+        control_saturated |= running_children >= jobs;
+        continue;
+
+skip:
+        // Files rejected by filters are not errors, so nothing is printed to
+        // stderr.
+        if (input_fd != -1) {
+            close(input_fd);
+        }
+        stats.files++;
+        stats.skipped++;
+        if (worker_fd != -1) {
+            send_result(sequence, "skipped", NULL);
+        } else if (json_output) {
+            write_json_result(path, "skipped", 0, NULL, 0, NULL, NULL);
+        } else if (watch_fd != -1) {
+            report_watch_match(path, 0, delimation);
+        }
+    }
+
+    if (batch_count) {
+        non_fatal_errors |= run_batch(&argv[optind], dev_null_fd, errout_fd,
+            delimation, display_on_success, json_output);
     }
 
     return (non_fatal_errors ? 2 : 0);
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Checks for the path filters of query. Usage: tests/filters.sh QUERY
+set -u
+
+query=$1
+directory=$(mktemp -d)
+trap 'rm -rf "$directory"' EXIT
+failures=0
+
+cd "$directory" || exit 1
+for name in 'foo*' foo fo fooo 'a?' a ab; do
+    : > "$name"
+done
+
+# Check that the files given as the first argument, separated by spaces, are
+# the ones "--include PATTERN" lets through.
+expect() {
+    actual=$(ls | "$query" --include "$2" true | sort | tr '\n' ' ')
+    if [ "$actual" != "$1 " ]; then
+        echo "--include '$2': expected '$1 ', got '$actual'" >&2
+        failures=$((failures + 1))
+    fi
+}
+
+expect 'foo*' 'foo\*'
+expect 'a?' 'a\?'
+expect 'foo foo* fooo' 'foo*'
+expect 'a? ab' 'a?'
+
+[ "$failures" -eq 0 ]